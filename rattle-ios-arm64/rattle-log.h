@@ -0,0 +1,177 @@
+#ifndef RATTLE_LOG_H
+#define RATTLE_LOG_H
+
+#include <stdint.h>
+
+/****************************************************************************/
+// Binary activity log
+//
+// A log file is an rlog_header followed by a stream of records. Every record
+// starts with a 16-bit type and a 16-bit size (including those four bytes)
+// and is padded to a multiple of 8 bytes, so readers can skip types they do
+// not know. The file may be longer than its contents while it is being
+// written; a record of type RLOG_END (zero) marks the end. All fields are in
+// host byte order.
+
+#define RLOG_MAGIC "RATTLOG"
+#define RLOG_VERSION 2             // readers also accept 1, which lacks the vector fields
+#define RLOG_ALIGN(n) (((n)+7) & ~7)
+
+struct rlog_header {
+  char magic[8];                    // RLOG_MAGIC, NUL-padded
+  uint32_t version;
+  uint32_t header_size;             // offset of the first record
+  char timebase[16];                // name of the tick source
+  double ticks_per_sec;
+  int64_t sleep_granularity_musec;
+  int64_t start_musec;              // zero point of all timestamps below
+  char vector[16];                  // kernel run by the FMA activity
+  uint32_t vector_bits;             // its register width
+  uint32_t reserved;
+};
+
+enum rlog_type {
+  RLOG_END  = 0,
+  RLOG_NAME = 1,  // defines the string for a name id
+  RLOG_STEP = 2,  // one executed step of the timeline
+  RLOG_CORES = 3, // per-core timing of the step before it
+  RLOG_SAMPLE = 4, // CPU frequencies and temperatures
+  RLOG_CORRECTION = 5, // a calibration change made during the run
+  RLOG_PERF = 6,  // hardware counters of the step before it
+  RLOG_SEQUENCE = 7, // a pseudo-random chip sequence in the schedule
+  RLOG_EDGES = 8, // actual transition times of the step before it
+};
+
+struct rlog_record {
+  uint16_t type;
+  uint16_t size;
+};
+
+struct rlog_name {
+  uint16_t type;
+  uint16_t size;
+  uint32_t id;
+  char name[];                      // NUL-terminated
+};
+
+struct rlog_step {
+  uint16_t type;
+  uint16_t size;
+  uint32_t name;                    // id from an earlier RLOG_NAME record
+  int64_t start_musec;
+  int64_t end_musec;
+  int64_t late_nsec;                // actual start minus scheduled start
+  // Newer writers add these; check size before reading them
+  int64_t deadline_musec;           // scheduled start
+  int64_t wanted_nsec;              // requested duration
+  int64_t over_nsec;                // actual end minus scheduled end
+};
+
+// Written after an RLOG_STEP that ran on several cores. offset_nsec holds
+// each core's actual start relative to the step's start deadline, followed
+// by each core's actual end relative to its end deadline. Cores that slept
+// through the step report RLOG_CORE_IDLE.
+#define RLOG_CORE_IDLE INT32_MIN
+
+struct rlog_cores {
+  uint16_t type;
+  uint16_t size;
+  uint32_t cores;
+  int32_t offset_nsec[];            // [2*cores]
+};
+
+// Written by the --monitor thread. value holds a (cpu, kHz) pair for each
+// sampled CPU, then a (thermal zone, millidegrees Celsius) pair per zone.
+struct rlog_sample {
+  uint16_t type;
+  uint16_t size;
+  uint16_t cpus;
+  uint16_t zones;
+  int64_t time_musec;
+  int32_t value[];                  // [2*(cpus+zones)]
+};
+
+enum rlog_fix {
+  RLOG_FIX_TICK_RATE = 1,           // ticks per second, from wall-clock drift
+  RLOG_FIX_UNROLL = 2,              // CODE copies per clock read of one loop
+};
+
+struct rlog_correction {
+  uint16_t type;
+  uint16_t size;
+  uint32_t fix;                     // enum rlog_fix
+  int64_t time_musec;
+  uint32_t name;                    // RLOG_FIX_UNROLL: the activity's name id
+  uint32_t reserved;
+  double before;
+  double after;
+};
+
+// Written after an RLOG_STEP when --perf counted it on the activity thread.
+// Counters the CPU or kernel could not provide read RLOG_PERF_MISSING.
+enum rlog_counter {
+  RLOG_PERF_CYCLES,
+  RLOG_PERF_INSTRUCTIONS,
+  RLOG_PERF_LLC_MISSES,
+  RLOG_PERF_BRANCH_MISSES,
+  RLOG_PERF_STALLED_BACKEND,
+  RLOG_PERF_COUNTERS
+};
+#define RLOG_PERF_MISSING INT64_MIN
+
+struct rlog_perf {
+  uint16_t type;
+  uint16_t size;
+  uint32_t counters;                // RLOG_PERF_COUNTERS when written
+  int64_t delta[];                  // [counters], indexed by enum rlog_counter
+};
+
+// Written once for each distinct prbs or gold line of the schedule. Chip k
+// ran the activity named by one if bit k is set, else the one named by
+// zero; bit k is bits[k/8] >> (k%8) & 1. Chip 0 was scheduled offset_sec
+// after the run's first step, before any slowdown. Each LFSR shifts right,
+// feeding back the parity of state & taps into the top bit, and emits its
+// lowest bit; a Gold code is the XOR of two such registers.
+enum rlog_sequence_kind {
+  RLOG_SEQ_MSEQ = 1,                // one maximal-length LFSR
+  RLOG_SEQ_GOLD = 2,                // two, from a preferred pair
+};
+
+struct rlog_sequence {
+  uint16_t type;
+  uint16_t size;
+  uint32_t kind;                    // enum rlog_sequence_kind
+  uint32_t degree;                  // register length in bits
+  uint32_t chips;                   // 2^degree-1
+  uint32_t seed;                    // initial state of the first register
+  uint32_t seed2;                   // Gold: of the second
+  uint32_t taps;
+  uint32_t taps2;
+  uint32_t one;                     // name ids
+  uint32_t zero;
+  double chip_sec;
+  double offset_sec;
+  uint8_t bits[];                   // [(chips+7)/8]
+};
+
+// Written after an RLOG_STEP that ran a chirp, in as many records as it
+// takes. late_nsec[k] is how much after its deadline transition first+k
+// happened: transition 2i is where period i's activity stopped, 2i+1 where
+// the period ended. Deadlines count from the step's scheduled start, over
+// its wanted duration T. A step named ACT/chirp/F0-F1Hz sweeps linearly,
+// with phase f0*t + (f1-f0)*t^2/(2*T) cycles, and ACT/chirp/F0-F1Hz/log
+// exponentially, with phase f0*T/ln(f1/f0) * ((f1/f0)^(t/T) - 1). Period i
+// runs from phase i to i+0.5 and ends at i+1; deadlines past T are cut to T.
+// A step that filled the recorder's edge ring has only its first
+// transitions recorded, as many as the records hold.
+#define RLOG_EDGES_MAX 8192        // transitions per record
+
+struct rlog_edges {
+  uint16_t type;
+  uint16_t size;
+  uint32_t first;
+  uint32_t count;
+  int32_t late_nsec[];              // [count]
+};
+
+#endif
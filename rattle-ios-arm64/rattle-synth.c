@@ -0,0 +1,651 @@
+// rattle-synth: renders the activity signal a rattle log describes, as a
+// reference to correlate captures against. Runs on the analysis host:
+//
+//   cc -O2 -o rattle-synth rattle-synth.c -lm
+//   rattle-synth [options] LOG OUT
+//
+// By default OUT is one channel holding the weight of whatever ran at each
+// moment: 1 for every step but SLEEP unless --weight says otherwise. With
+// --split it has one channel per activity instead, 1 while it runs. PWM
+// and chirp steps are rendered period by period, chirps where the log says
+// each transition actually happened. Samples average the signal over
+// their interval, so step edges fall between samples where they happened.
+// Sample 0 is the log's zero point, like the times of the "> " lines.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "rattle-log.h"
+
+/****************************************************************************/
+// Misc
+
+#define MAX(a,b)      ((a) > (b) ? (a) : (b))
+#define MIN(a,b)      ((a) < (b) ? (a) : (b))
+
+#define MUSEC_SEC 1000000LL
+#define CHUNK 65536           // frames rendered per channel at a time
+#define MAX_CHANNELS 64
+#define MAX_WEIGHTS 64
+
+void error(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  exit(1);
+}
+
+static void usage() {
+  error("Usage: rattle-synth [options] LOG OUT\n"
+        "  --rate HZ         sample rate (default 48000)\n"
+        "  --split           one channel per activity rather than a weighted sum\n"
+        "  --weight NAME=W   weight of an activity or step name in the sum\n"
+        "  --format wav|f32  32-bit float WAV or raw (default: wav if OUT ends in .wav)\n"
+        "  --fft FILE        also write the magnitude spectrum of OUT as text\n"
+        "  --fft-size N      points per FFT segment, a power of two (default 65536)\n"
+        "LOG and OUT may be - for stdin and stdout; --split needs LOG to be a file.");
+}
+
+static void put_le(unsigned char *p, uint32_t v, int bytes) {
+  int i;
+  for (i=0; i<bytes; ++i)
+    p[i] = v >> (8*i);
+}
+
+
+/****************************************************************************/
+// Log reading
+//
+// Records are read one at a time, so memory stays bounded however long the
+// log is.
+
+static FILE *log_file;
+static struct rlog_header header;
+static union {
+  struct rlog_record rec;
+  uint64_t align;
+  unsigned char bytes[65536];
+} record;
+
+static char **names;          // by name id
+static unsigned int num_names;
+
+static void open_log(const char *path) {
+  log_file = strcmp(path, "-")==0 ? stdin : fopen(path, "rb");
+  if (log_file==NULL)
+    error("Cannot open %s: %s", path, strerror(errno));
+  if (fread(&header, sizeof(header), 1, log_file)!=1)
+    error("%s: log file too short", path);
+  if (strncmp(header.magic, RLOG_MAGIC, sizeof(header.magic))!=0 || header.version<1 || header.version>RLOG_VERSION)
+    error("%s: not a rattle log (or wrong version)", path);
+}
+
+static void rewind_log() {
+  if (fseek(log_file, header.header_size, SEEK_SET)!=0)
+    error("Cannot seek in the log: %s", strerror(errno));
+}
+
+// Returns the next record, or NULL at the end. Names are kept as they come.
+static const struct rlog_record *next_record() {
+  if (fread(&record.rec, sizeof(record.rec), 1, log_file)!=1 || record.rec.type==RLOG_END
+      || record.rec.size<sizeof(record.rec))
+    return NULL;
+  if (fread(record.bytes+sizeof(record.rec), record.rec.size-sizeof(record.rec), 1, log_file)!=1)
+    return NULL;
+  record.bytes[record.rec.size] = '\0';
+  if (record.rec.type==RLOG_NAME) {
+    const struct rlog_name *name = (const struct rlog_name *)&record;
+    if (name->id>=num_names) {
+      if ((names = realloc(names, (name->id+1)*sizeof(*names)))==NULL)
+        error("next_record: realloc failed");
+      while (num_names<=name->id)
+        names[num_names++] = "?";
+    }
+    if ((names[name->id] = strdup(name->name))==NULL)
+      error("next_record: strdup failed");
+  }
+  return &record.rec;
+}
+
+static const char *name_of(uint32_t id) {
+  return id<num_names ? names[id] : "?";
+}
+
+
+/****************************************************************************/
+// Steps
+//
+// Each step name resolves once to a channel, a weight and, for names like
+// MUL/20us/10-90% or MUL/chirp/100-2000Hz, the PWM that switched it.
+
+struct kind {
+  const char *name;
+  int channel;         // -1: not rendered
+  float weight;
+  int pwm;
+  double period_sec, duty0, duty1;  // duties in percent
+  int chirp;                        // 0, or 1 for linear and 2 for log
+  double f0, f1;
+};
+
+static struct kind *kinds;    // by name id, filled on first use
+static int *kind_known;
+static unsigned int num_kinds;
+
+static int split;
+static int channels = 1;
+static const char *channel_name[MAX_CHANNELS];
+
+static struct { const char *name; float weight; } weights[MAX_WEIGHTS];
+static int num_weights;
+
+static float weight_of(const char *name, float otherwise) {
+  int i;
+  for (i=0; i<num_weights; ++i)
+    if (strcmp(weights[i].name, name)==0)
+      return weights[i].weight;
+  return otherwise;
+}
+
+static int channel_of(const char *name, int create) {
+  int c;
+  if (strcmp(name, "SLEEP")==0)
+    return -1;
+  for (c=0; c<channels; ++c)
+    if (strcmp(channel_name[c], name)==0)
+      return c;
+  if (!create)
+    error("No channel for %s", name);
+  if (channels==MAX_CHANNELS)
+    error("More than %d activities to split", MAX_CHANNELS);
+  channel_name[channels] = strdup(name);
+  return channels++;
+}
+
+static const struct kind *kind_of(uint32_t id, int create_channel) {
+  struct kind *k;
+  const char *rest;
+  char *act;
+  size_t len;
+  int n = 0;
+  if (id>=num_kinds) {
+    kinds = realloc(kinds, (id+1)*sizeof(*kinds));
+    kind_known = realloc(kind_known, (id+1)*sizeof(*kind_known));
+    if (kinds==NULL || kind_known==NULL)
+      error("kind_of: realloc failed");
+    while (num_kinds<=id)
+      kind_known[num_kinds++] = 0;
+  }
+  k = &kinds[id];
+  if (kind_known[id])
+    return k;
+  kind_known[id] = 1;
+  k->name = name_of(id);
+  k->pwm = 0;
+  k->chirp = 0;
+  // The activity is everything before the first '/', however long
+  len = strcspn(k->name, "/");
+  rest = k->name+len;
+  if (len>0 && sscanf(rest, "/chirp/%lf-%lfHz%n", &k->f0, &k->f1, &n)==2 && k->f0>0 && k->f1>0) {
+    k->pwm = 1;
+    k->chirp = strcmp(rest+n, "/log")==0 ? 2 : 1;
+  } else if (len>0 && sscanf(rest, "/%lfus/%lf%n", &k->period_sec, &k->duty0, &n)==2 && k->period_sec>0) {
+    k->pwm = 1;
+    k->period_sec *= 1e-6;
+    k->duty1 = k->duty0;
+    if (rest[n]=='-')
+      sscanf(rest+n, "-%lf", &k->duty1);
+  } else
+    len = strlen(k->name);
+  if ((act = malloc(len+1))==NULL)
+    error("kind_of: malloc failed");
+  memcpy(act, k->name, len);
+  act[len] = 0;
+  if (split) {
+    k->channel = channel_of(act, create_channel);
+    k->weight = 1;
+  } else {
+    // A PWM step weighs what its activity does, unless named itself
+    k->channel = 0;
+    k->weight = weight_of(k->name, weight_of(act, strcmp(act, "SLEEP")==0 ? 0 : 1));
+  }
+  free(act);
+  return k;
+}
+
+
+/****************************************************************************/
+// Spectrum
+//
+// Welch's method: the output is cut into fft_size segments, each is Hann
+// windowed and transformed, and the powers are averaged. A log shorter
+// than one segment is zero-padded.
+
+static const char *fft_path;
+static int fft_size = 65536;
+static double *fft_window, *fft_cos, *fft_sin;
+static double *fft_re, *fft_im;
+static double *fft_in[MAX_CHANNELS], *fft_power[MAX_CHANNELS];
+static int fft_fill;
+static long fft_segments;
+
+static void init_fft() {
+  int i, c;
+  if (fft_size<2 || (fft_size & (fft_size-1)))
+    error("--fft-size must be a power of two");
+  fft_window = malloc(fft_size*sizeof(double));
+  fft_cos = malloc(fft_size/2*sizeof(double));
+  fft_sin = malloc(fft_size/2*sizeof(double));
+  fft_re = malloc(fft_size*sizeof(double));
+  fft_im = malloc(fft_size*sizeof(double));
+  if (fft_window==NULL || fft_cos==NULL || fft_sin==NULL || fft_re==NULL || fft_im==NULL)
+    error("init_fft: malloc failed");
+  for (i=0; i<fft_size; ++i)
+    fft_window[i] = 0.5 - 0.5*cos(2*M_PI*i/fft_size);
+  for (i=0; i<fft_size/2; ++i) {
+    fft_cos[i] = cos(2*M_PI*i/fft_size);
+    fft_sin[i] = -sin(2*M_PI*i/fft_size);
+  }
+  for (c=0; c<channels; ++c) {
+    fft_in[c] = malloc(fft_size*sizeof(double));
+    fft_power[c] = calloc(fft_size/2+1, sizeof(double));
+    if (fft_in[c]==NULL || fft_power[c]==NULL)
+      error("init_fft: malloc failed");
+  }
+}
+
+// In place, radix 2
+static void fft(double *re, double *im, int n) {
+  int i, j, k, len, half;
+  for (i=1, j=0; i<n; ++i) {
+    int bit = n>>1;
+    for (; j & bit; bit>>=1)
+      j ^= bit;
+    j ^= bit;
+    if (i<j) {
+      double t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (len=2; len<=n; len<<=1) {
+    half = len/2;
+    for (i=0; i<n; i+=len)
+      for (k=0; k<half; ++k) {
+        double wr = fft_cos[k*(n/len)], wi = fft_sin[k*(n/len)];
+        double *ar = re+i+k, *ai = im+i+k, *br = ar+half, *bi = ai+half;
+        double tr = *br*wr - *bi*wi, ti = *br*wi + *bi*wr;
+        *br = *ar-tr; *bi = *ai-ti;
+        *ar += tr; *ai += ti;
+      }
+  }
+}
+
+static void fft_segment() {
+  int c, i;
+  for (c=0; c<channels; ++c) {
+    for (i=0; i<fft_size; ++i) {
+      fft_re[i] = i<fft_fill ? fft_in[c][i]*fft_window[i] : 0;
+      fft_im[i] = 0;
+    }
+    fft(fft_re, fft_im, fft_size);
+    for (i=0; i<=fft_size/2; ++i)
+      fft_power[c][i] += fft_re[i]*fft_re[i] + fft_im[i]*fft_im[i];
+  }
+  ++fft_segments;
+  fft_fill = 0;
+}
+
+// planar is [channels][CHUNK]
+static void fft_feed(const float *planar, int frames) {
+  int c, i, n;
+  for (i=0; i<frames; i+=n) {
+    n = MIN(frames-i, fft_size-fft_fill);
+    for (c=0; c<channels; ++c) {
+      const float *src = planar + (size_t)c*CHUNK + i;
+      double *dst = fft_in[c] + fft_fill;
+      int k;
+      for (k=0; k<n; ++k)
+        dst[k] = src[k];
+    }
+    fft_fill += n;
+    if (fft_fill==fft_size)
+      fft_segment();
+  }
+}
+
+// One line per bin: frequency, then each channel's amplitude in dB. A sine
+// of amplitude A reads 20*log10(A/2).
+static void write_fft(double rate) {
+  FILE *f;
+  double gain = 0;
+  int c, i;
+  if (fft_fill>0 && fft_segments==0)
+    fft_segment();
+  if ((f = fopen(fft_path, "w"))==NULL)
+    error("Cannot open %s: %s", fft_path, strerror(errno));
+  for (i=0; i<fft_size; ++i)
+    gain += fft_window[i];
+  fprintf(f, "# rattle-synth spectrum: %d points at %gHz, %ld segments, Hann window\n# Hz", fft_size, rate, fft_segments);
+  for (c=0; c<channels; ++c)
+    fprintf(f, " %s", split ? channel_name[c] : "sum");
+  fputc('\n', f);
+  for (i=0; i<=fft_size/2; ++i) {
+    fprintf(f, "%.4f", i*rate/fft_size);
+    for (c=0; c<channels; ++c) {
+      double mag = sqrt(fft_segments ? fft_power[c][i]/fft_segments : 0)/gain;
+      fprintf(f, " %.2f", mag>0 ? 20*log10(mag) : -400.0);
+    }
+    fputc('\n', f);
+  }
+  fclose(f);
+}
+
+
+/****************************************************************************/
+// Rendering
+//
+// Steps come in time order, so the output is built one chunk at a time:
+// everything before the chunk is written out, and nothing after it has been
+// read yet. Channels are planar while rendering, so filling a step is one
+// contiguous loop the compiler vectorizes.
+
+static double rate = 48000;
+static int wav = -1;
+static FILE *out;
+static float *chunk;          // [channels][CHUNK]
+static float *frames;         // [CHUNK][channels], as written
+static int64_t chunk_base;    // frame number of chunk[0]
+static uint64_t out_bytes;
+
+static void wav_header(unsigned char *h, uint32_t data_bytes) {
+  memcpy(h, "RIFF", 4);
+  put_le(h+4, 36+data_bytes, 4);
+  memcpy(h+8, "WAVEfmt ", 8);
+  put_le(h+16, 16, 4);
+  put_le(h+20, 3, 2);                      // IEEE float
+  put_le(h+22, channels, 2);
+  put_le(h+24, (uint32_t)rate, 4);
+  put_le(h+28, (uint32_t)rate*channels*sizeof(float), 4);
+  put_le(h+32, channels*sizeof(float), 2);
+  put_le(h+34, 8*sizeof(float), 2);
+  memcpy(h+36, "data", 4);
+  put_le(h+40, data_bytes, 4);
+}
+
+static void open_output(const char *path) {
+  unsigned char h[44];
+  out = strcmp(path, "-")==0 ? stdout : fopen(path, "wb");
+  if (out==NULL)
+    error("Cannot open %s: %s", path, strerror(errno));
+  chunk = calloc((size_t)channels*CHUNK, sizeof(float));
+  frames = malloc((size_t)channels*CHUNK*sizeof(float));
+  if (chunk==NULL || frames==NULL)
+    error("open_output: malloc failed");
+  if (wav) {
+    wav_header(h, UINT32_MAX-36);          // streaming readers read to EOF
+    fwrite(h, 1, sizeof(h), out);
+  }
+}
+
+// Writes the first n frames of the chunk and starts the next one
+static void flush_chunk(int n) {
+  int c, i;
+  if (channels==1)
+    memcpy(frames, chunk, n*sizeof(float));
+  else
+    for (c=0; c<channels; ++c)
+      for (i=0; i<n; ++i)
+        frames[(size_t)i*channels+c] = chunk[(size_t)c*CHUNK+i];
+  if (fwrite(frames, sizeof(float)*channels, n, out)!=(size_t)n)
+    error("Cannot write output: %s", strerror(errno));
+  out_bytes += (uint64_t)n*channels*sizeof(float);
+  if (fft_path)
+    fft_feed(chunk, n);
+  memset(chunk, 0, (size_t)channels*CHUNK*sizeof(float));
+  chunk_base += CHUNK;
+}
+
+static void close_output() {
+  unsigned char h[44];
+  if (wav && out_bytes<=UINT32_MAX-36 && fseek(out, 0, SEEK_SET)==0) {
+    wav_header(h, (uint32_t)out_bytes);
+    fwrite(h, 1, sizeof(h), out);
+  }
+  if (fclose(out)!=0)
+    error("Cannot write output: %s", strerror(errno));
+}
+
+// Adds v over frames [a,b) of one channel of the chunk, and the covered
+// fraction of v to a partly covered first or last frame.
+static void fill(float *buf, double a, double b, float v) {
+  int64_t i = (int64_t)a, j = (int64_t)b, k;
+  if (i==j) {
+    buf[i] += v*(b-a);
+    return;
+  }
+  buf[i] += v*(i+1-a);
+  for (k=i+1; k<j; ++k)
+    buf[k] += v;
+  if (j<CHUNK)
+    buf[j] += v*(b-j);
+}
+
+// Times in seconds from the log's zero point; earlier spans may not follow
+// later ones.
+static void render(double start, double end, int channel, float v) {
+  double a = MAX(start*rate, (double)chunk_base), b = end*rate;
+  while (a<b) {
+    if (a>=chunk_base+CHUNK) {
+      flush_chunk(CHUNK);
+      continue;
+    }
+    double lim = MIN(b, (double)(chunk_base+CHUNK));
+    if (v!=0)
+      fill(chunk+(size_t)channel*CHUNK, a-chunk_base, lim-chunk_base, v);
+    a = lim;
+  }
+}
+
+// The PWM's edges counted from the step's deadline, as rattle made them,
+// cut to when the step actually ran.
+static void render_pwm(const struct kind *k, double start, double end, double deadline, double wanted) {
+  int periods = (int)ceil(wanted/k->period_sec - 1e-9), i;
+  for (i=0; i<periods; ++i) {
+    double duty = periods>1 ? k->duty0 + (k->duty1-k->duty0)*i/(periods-1) : k->duty0;
+    double on = deadline + i*k->period_sec, off = deadline + (i+duty/100)*k->period_sec;
+    if (on>=end)
+      break;
+    if (off>start)
+      render(MAX(on, start), MIN(off, end), k->channel, k->weight);
+  }
+}
+
+// Seconds from a chirp's start to where its phase reaches the given cycles
+// (see rattle-log.h), at most T
+static double chirp_time(const struct kind *k, double T, double cycles) {
+  double t;
+  if (k->f1==k->f0)
+    t = cycles/k->f0;
+  else if (k->chirp==2)
+    t = T*log1p(cycles*log(k->f1/k->f0)/(k->f0*T))/log(k->f1/k->f0);
+  else
+    t = 2*cycles/(k->f0+sqrt(k->f0*k->f0+2*(k->f1-k->f0)/T*cycles));
+  return MIN(t, T);
+}
+
+// Periods from the given one on, where they were due
+static void render_chirp(const struct kind *k, double start, double end, double deadline, double wanted,
+                         int from) {
+  int i;
+  for (i=from; ; ++i) {
+    double on = deadline + chirp_time(k, wanted, i), off = deadline + chirp_time(k, wanted, i+0.5);
+    if (on>=end || chirp_time(k, wanted, i)>=wanted)
+      break;
+    if (off>start)
+      render(MAX(on, start), MIN(off, end), k->channel, k->weight);
+  }
+}
+
+// A chirp step is held until its RLOG_EDGES records, if any, have been
+// read. With them each period is rendered where it actually ran, and
+// periods past the last recorded transition where they were due.
+static struct {
+  const struct kind *k;   // NULL: none pending
+  double start, end, deadline, wanted;
+  double on;              // when the current period's activity started
+  int edges;              // transitions seen so far
+} pending;
+
+static void pending_edges(const struct rlog_edges *rec) {
+  uint32_t j;
+  for (j=0; j<rec->count && sizeof(*rec)+(j+1)*sizeof(int32_t)<=rec->size; ++j) {
+    uint32_t e = rec->first+j;
+    double t = pending.deadline + chirp_time(pending.k, pending.wanted, e/2 + (e%2 ? 1 : 0.5))
+               + rec->late_nsec[j]*1e-9;
+    if (e%2==0)
+      render(MAX(pending.on, pending.start), MAX(t, pending.start), pending.k->channel, pending.k->weight);
+    else
+      pending.on = t;
+    ++pending.edges;
+  }
+}
+
+static void finish_pending() {
+  if (pending.k)
+    // After an even transition that period is done and the next one is
+    // rendered where it was due; after an odd one it runs on from pending.on.
+    render_chirp(pending.k, pending.edges%2 ? pending.start : MAX(pending.start, pending.on), pending.end,
+                 pending.deadline, pending.wanted, (pending.edges+1)/2);
+  pending.k = NULL;
+}
+
+static double sec_of(int64_t musec) {
+  return (double)(musec-header.start_musec)/MUSEC_SEC;
+}
+
+// --split needs every channel before the first frame is written
+static void find_channels() {
+  const struct rlog_record *rec;
+  channels = 0;
+  while ((rec = next_record())!=NULL)
+    if (rec->type==RLOG_STEP)
+      kind_of(((const struct rlog_step *)rec)->name, 1);
+  if (channels==0)
+    error("Nothing to split: the log has no steps besides SLEEP");
+  rewind_log();
+}
+
+static void synthesize() {
+  const struct rlog_record *rec;
+  double last_end = 0;
+  int64_t total;
+  long steps = 0;
+  while ((rec = next_record())!=NULL) {
+    const struct rlog_step *step = (const struct rlog_step *)rec;
+    const struct kind *k;
+    double start, end;
+    if (rec->type==RLOG_EDGES && pending.k)
+      pending_edges((const struct rlog_edges *)rec);
+    if (rec->type!=RLOG_STEP)
+      continue;
+    finish_pending();
+    k = kind_of(step->name, 0);
+    start = sec_of(step->start_musec);
+    end = sec_of(step->end_musec);
+    if (k->channel>=0) {
+      if (k->chirp && step->size>=sizeof(*step)) {
+        pending.k = k;
+        pending.start = pending.on = start;
+        pending.end = end;
+        pending.deadline = sec_of(step->deadline_musec);
+        pending.wanted = step->wanted_nsec*1e-9;
+        pending.edges = 0;
+      } else if (k->pwm && !k->chirp && step->size>=sizeof(*step))
+        render_pwm(k, start, end, sec_of(step->deadline_musec), step->wanted_nsec*1e-9);
+      else
+        render(start, end, k->channel, k->weight);
+    }
+    last_end = MAX(last_end, end);
+    ++steps;
+  }
+  finish_pending();
+  total = (int64_t)ceil(last_end*rate);
+  while (total>chunk_base)
+    flush_chunk((int)MIN(total-chunk_base, CHUNK));
+  fprintf(stderr, "# %ld steps, %.6f sec, %lld frames of %d channel%s at %gHz\n",
+          steps, last_end, (long long)total, channels, channels>1 ? "s" : "", rate);
+}
+
+
+/****************************************************************************/
+// Main
+
+int main(int argc, char **argv) {
+  const char *log_path = NULL, *out_path = NULL;
+  size_t len;
+  int i, c;
+  for (i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"--rate")==0 && i+1<argc) {
+      rate = atof(argv[++i]);
+      if (!(rate>=1 && rate<=UINT32_MAX/(MAX_CHANNELS*sizeof(float))))
+        error("--rate out of range");
+    } else if (strcmp(argv[i],"--split")==0) {
+      split = 1;
+    } else if (strcmp(argv[i],"--weight")==0 && i+1<argc) {
+      char *eq = strchr(argv[++i], '=');
+      if (eq==NULL)
+        error("--weight wants NAME=W: %s", argv[i]);
+      if (num_weights==MAX_WEIGHTS)
+        error("Too many --weight options");
+      *eq = '\0';
+      weights[num_weights].name = argv[i];
+      weights[num_weights++].weight = atof(eq+1);
+    } else if (strcmp(argv[i],"--format")==0 && i+1<argc) {
+      ++i;
+      if (strcmp(argv[i],"wav")==0)
+        wav = 1;
+      else if (strcmp(argv[i],"f32")==0)
+        wav = 0;
+      else
+        error("--format wants wav or f32: %s", argv[i]);
+    } else if (strcmp(argv[i],"--fft")==0 && i+1<argc) {
+      fft_path = argv[++i];
+    } else if (strcmp(argv[i],"--fft-size")==0 && i+1<argc) {
+      fft_size = atoi(argv[++i]);
+    } else if (argv[i][0]=='-' && argv[i][1]!='\0') {
+      usage();
+    } else if (log_path==NULL) {
+      log_path = argv[i];
+    } else if (out_path==NULL) {
+      out_path = argv[i];
+    } else
+      usage();
+  }
+  if (log_path==NULL || out_path==NULL)
+    usage();
+  if (wav<0)
+    wav = (len = strlen(out_path))>=4 && strcmp(out_path+len-4, ".wav")==0;
+  if (split && strcmp(log_path, "-")==0)
+    error("--split needs LOG to be a file");
+
+  open_log(log_path);
+  if (split) {
+    find_channels();
+    for (c=0; c<channels; ++c)
+      fprintf(stderr, "# Channel %d: %s\n", c, channel_name[c]);
+  }
+  if (fft_path)
+    init_fft();
+  open_output(out_path);
+  synthesize();
+  close_output();
+  if (fft_path)
+    write_fft(rate);
+  return 0;
+}
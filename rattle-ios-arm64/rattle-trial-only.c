@@ -1,3 +1,6 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <sched.h>
@@ -7,9 +10,44 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <sys/sysctl.h>
+#endif
+
+#if defined(__arm64__) || defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(RATTLE_ALSA)
+#include <alsa/asoundlib.h>
+#endif
+
+#include "rattle-log.h"
 
 /****************************************************************************/
 // Misc
@@ -22,7 +60,7 @@ static int shouting;
 static int spiking;
 float slowdown=1;
 
-#define SAND_SIZE (8*1024*1024)     // must be power of 2
+#define SAND_SIZE (8*1024*1024)     // default memory working set, in ints
 #define MUSEC_SEC 1000000LL
 
 typedef long long tick_t;
@@ -31,12 +69,19 @@ typedef long long musec_t;
 static tick_t ticks_per_sec = 0;
 static musec_t sleep_granularity = 0;
 static musec_t start_musec = 0;
+static char vector_name[16] = "none";   // kernel behind the FMA activity
+static unsigned int vector_bits = 0;
 
 typedef enum
-  {A_NONE, A_SLEEP , A_MUL   , A_FMUL  , A_ADD   , A_MEMORY, A_PAUSE, A_MUL_FMUL, A_DIV2, A_DIV8209, A_MEMW0, A_MEMW1, NUM_ACTIVITY} activity_t;
+  {A_NONE, A_SLEEP , A_MUL   , A_FMUL  , A_ADD   , A_MEMORY, A_PAUSE, A_MUL_FMUL, A_DIV2, A_DIV8209, A_MEMW0, A_MEMW1,
+   A_FMA , A_FMA128, A_FMA256, A_FMA512, A_FMASVE, A_PINGPONG, A_CONTEND, A_FALSESHARE, A_HANDOFF, NUM_ACTIVITY} activity_t;
 const int activity_shout_freq[NUM_ACTIVITY] =
 //{0     , 100     , 200     , 220 0   , 1400    ,  600    , 1000    };
-  {0     , 262     , 294     , 330     , 370     ,  415    , 466     , 0        , 0     , 0        , 0      , 0       }; // , 2093
+  {0     , 262     , 294     , 330     , 370     ,  415    , 466     , 0        , 0     , 0        , 0      , 0      ,
+   0     , 0       , 0       , 0       , 0       , 0         , 0        , 0           , 0        }; // , 2093
+static const char *const activity_name[NUM_ACTIVITY] =
+  {"NONE", "SLEEP" , "MUL"   , "FMUL"  , "ADD"   , "MEMORY", "PAUSE", "MUL_FMUL", "DIV2", "DIV8209", "MEMW0", "MEMW1",
+   "FMA" , "FMA128", "FMA256", "FMA512", "FMASVE", "PINGPONG", "CONTEND", "FALSESHARE", "HANDOFF"};
 #define SHOUT_OCTAVE 4
      
 
@@ -45,57 +90,95 @@ static inline musec_t get_time_musec();
 /****************************************************************************/
 // Logging and reporting
 
+// A thread that can carry on after an error (the control thread, loading a
+// schedule) sets error_bail, and errors are reported to error_out and
+// longjmp() there instead of ending the run.
+static _Thread_local jmp_buf *error_bail;
+static _Thread_local FILE *error_out;
+
+static FILE *error_stream() {
+  return error_bail ? error_out : stderr;
+}
+
+static void error_exit() {
+  if (error_bail)
+    longjmp(*error_bail, 1);
+  exit(1);
+}
+
 void error(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
-  vfprintf(stderr, format, ap);
+  vfprintf(error_stream(), format, ap);
   va_end(ap);
-  fputc('\n', stderr);
-  exit(1);
+  fputc('\n', error_stream());
+  error_exit();
 }
 
 
-void say(const char *format, ...) {
-  if (verbose) {
-    long long stamp = get_time_musec() - start_musec;
-    va_list ap;
-    printf("%lld.%06lld: ", stamp/MUSEC_SEC, stamp%MUSEC_SEC);
-    va_start(ap, format);
-    vprintf(format, ap);
-    va_end(ap);
-    putchar('\n');
-  }
-}
-
+void say(const char *format, ...);
+void note(const char *format, ...);
 
-#define MAX_LOG_ENTRIES 100000
 
 struct log_entry {
   const char* activity;
   musec_t start_musec;
   musec_t end_musec;
+  long long late_nsec; // actual start minus scheduled start
+  long long wanted_nsec; // requested duration
+  long long over_nsec; // actual end minus scheduled end
+  int cores;           // >0: followed by a log_cores for that many cores
+  int perf;            // followed by a log_perf
+  int edges;           // transitions recorded in the edge ring
 };
 
-static struct log_entry log_data[MAX_LOG_ENTRIES];
-static unsigned int log_length = 0;
+#define MAX_WORKERS 64
 
-static void tell_log(const struct log_entry *entry) {
-  if (log_length>=MAX_LOG_ENTRIES)
-    error("Log overflow");
-  log_data[log_length] = *entry;
-  ++log_length;
-}
+// When each core actually started and stopped a step, relative to the
+// step's start and end deadline.
+struct log_cores {
+  int32_t start_nsec[MAX_WORKERS];
+  int32_t end_nsec[MAX_WORKERS];
+};
 
-static void dump_log() {
-  unsigned int i;
-  for (i=0; i<log_length; ++i) {
-    printf("> %12.9f %12.9f %12.9f  %s\n",
-       ((double)(log_data[i].start_musec-start_musec))/MUSEC_SEC,
-       ((double)(log_data[i].end_musec-start_musec))/MUSEC_SEC,
-       ((double)(log_data[i].end_musec-log_data[i].start_musec))/MUSEC_SEC,
-       log_data[i].activity);
-  }
-}
+#define MONITOR_MAX_ZONES 32
+
+// Frequencies and temperatures read by the monitor thread (see rattle-log.h)
+struct log_sample {
+  musec_t time_musec;
+  int cpus, zones;
+  int32_t value[2*(MAX_WORKERS+MONITOR_MAX_ZONES)];
+};
+
+// A calibration change made during the run
+struct log_correction {
+  int fix;              // enum rlog_fix
+  const char *name;     // RLOG_FIX_UNROLL: the activity
+  musec_t time_musec;
+  double before, after;
+};
+
+// Hardware counter deltas over one step, indexed by enum rlog_counter
+struct log_perf {
+  int64_t delta[RLOG_PERF_COUNTERS];
+};
+
+// A prbs or gold sequence of the schedule (see rattle-log.h). The writer
+// logs it from this pointer, so it must live until the writer has done so.
+struct log_sequence {
+  int kind, degree, chips;
+  uint32_t seed, seed2, taps, taps2;
+  activity_t one, zero;
+  double chip_sec, offset_sec;
+  uint8_t *bits;
+};
+
+static void tell_log(const struct log_entry *entry);
+static int tell_log_cores(const struct log_cores *cores);
+static int tell_log_perf(const struct log_perf *perf);
+static void tell_log_sample(const struct log_sample *sample);
+static void tell_log_correction(const struct log_correction *correction);
+static void tell_log_sequence(const struct log_sequence *sequence);
 
 
 /****************************************************************************/
@@ -141,31 +224,552 @@ static void init_spiking() {}
 static void cleanup_spiking() {}
 #endif
 
+/****************************************************************************/
+// Timing
+
+static inline musec_t get_time_musec() {
+  struct timeval tv;
+  if (gettimeofday(&tv, NULL)!=0)
+    error("gettimeofday failed: %s", strerror(errno));
+  return tv.tv_sec*MUSEC_SEC + tv.tv_usec;
+}
+
+
+/****************************************************************************/
+// Timebase
+//
+// rdtscll() reads the active tick counter. Several backends are compiled in;
+// init_timebase() probes which ones this CPU supports, calibrates each of
+// them against get_time_musec() and selects one (or the one asked for with
+// --timebase). The hot path is a switch on a variable that never changes
+// after startup, so the branch predictor makes the dispatch free.
+
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+typedef enum {TB_CNTVCT, TB_RDTSC, TB_RDTSCP, TB_MONORAW, NUM_TIMEBASE} timebase_t;
+static const char *const timebase_name[NUM_TIMEBASE] =
+  {"cntvct", "rdtsc", "rdtscp", "monoraw"};
+
+struct timebase_info {
+  int available;
+  double ticks_per_sec;   // calibrated against get_time_musec()
+  double nominal_hz;      // what the hardware claims, 0 if unknown
+  double read_nsec;       // cost of one back-to-back read
+  double resolution_nsec; // smallest non-zero step seen between reads
+};
+
+static timebase_t timebase = TB_MONORAW;
+static struct timebase_info timebase_info[NUM_TIMEBASE];
+
+static inline tick_t read_monoraw() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (tick_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+#if defined(__arm64__) || defined(__aarch64__)
+static inline tick_t read_cntvct() {
+  tick_t val;
+  asm volatile("isb; mrs %0, cntvct_el0" : "=r" (val) : : "memory");
+  return val;
+}
+#define read_rdtsc()  read_monoraw()
+#define read_rdtscp() read_monoraw()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+static inline tick_t read_rdtsc() {
+  unsigned int lo, hi;
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((tick_t)hi<<32) | lo;
+}
+static inline tick_t read_rdtscp() {
+  unsigned int lo, hi, aux;
+  asm volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+  return ((tick_t)hi<<32) | lo;
+}
+#define read_cntvct() read_monoraw()
+#else
+#define read_cntvct() read_monoraw()
+#define read_rdtsc()  read_monoraw()
+#define read_rdtscp() read_monoraw()
+#endif
+
+static inline tick_t read_ticks() {
+  switch (timebase) {
+  case TB_CNTVCT: return read_cntvct();
+  case TB_RDTSC:  return read_rdtsc();
+  case TB_RDTSCP: return read_rdtscp();
+  default:        return read_monoraw();
+  }
+}
+
+#define rdtscll(val) ((val) = read_ticks())
+
+static void probe_timebases() {
+  timebase_info[TB_MONORAW].available = 1;
+  timebase_info[TB_MONORAW].nominal_hz = 1e9;
+#if defined(__arm64__) || defined(__aarch64__)
+  {
+    tick_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    timebase_info[TB_CNTVCT].available = 1;
+    timebase_info[TB_CNTVCT].nominal_hz = freq;
+  }
+#elif defined(__x86_64__) || defined(__i386__)
+  {
+    unsigned int eax, ebx, ecx, edx;
+    timebase_info[TB_RDTSC].available = 1;
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1<<27)))
+      timebase_info[TB_RDTSCP].available = 1;
+  }
+#endif
+}
+
+// A TSC that is not invariant changes rate with DVFS, which is exactly what
+// we must not time activities with.
+static int tsc_is_invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1<<8));
+#else
+  return 0;
+#endif
+}
+
+#define TIMEBASE_COST_READS 100000
+
+static void calibrate_timebase(timebase_t tb, float calib_sec) {
+  struct timebase_info *info = &timebase_info[tb];
+  timebase_t saved = timebase;
+  tick_t t0, t1, prev, now, step, min_step = 0;
+  musec_t m0, m1;
+  int i;
+
+  timebase = tb;
+  // Bracket the reference clock with tick reads on both ends, so the
+  // gettimeofday() cost does not bias the rate.
+  rdtscll(t0);
+  m0 = get_time_musec();
+  do {
+    m1 = get_time_musec();
+  } while (m1-m0 < calib_sec*MUSEC_SEC);
+  rdtscll(t1);
+  info->ticks_per_sec = (double)(t1-t0)*MUSEC_SEC/(m1-m0);
+
+  m0 = get_time_musec();
+  rdtscll(prev);
+  for (i=0; i<TIMEBASE_COST_READS; ++i) {
+    rdtscll(now);
+    step = now-prev;
+    if (step>0 && (min_step==0 || step<min_step))
+      min_step = step;
+    prev = now;
+  }
+  m1 = get_time_musec();
+  info->read_nsec = 1000.0*(m1-m0)/TIMEBASE_COST_READS;
+  info->resolution_nsec = min_step*1e9/info->ticks_per_sec;
+  timebase = saved;
+}
+
+static void init_timebase(const char *requested, float calib_sec) {
+  timebase_t tb;
+  probe_timebases();
+  if (requested) {
+    for (tb=0; tb<NUM_TIMEBASE; ++tb)
+      if (strcmp(requested, timebase_name[tb])==0)
+        break;
+    if (tb==NUM_TIMEBASE)
+      error("Unknown timebase: %s", requested);
+    if (!timebase_info[tb].available)
+      error("Timebase %s is not available on this machine", requested);
+    timebase = tb;
+  } else if (timebase_info[TB_CNTVCT].available) {
+    timebase = TB_CNTVCT;
+  } else if (timebase_info[TB_RDTSC].available && tsc_is_invariant()) {
+    timebase = TB_RDTSC;
+  } else {
+    timebase = TB_MONORAW;
+  }
+
+  // Only the selected backend gets the full calibration period; the others
+  // are calibrated briefly so that their cost can be reported.
+  for (tb=0; tb<NUM_TIMEBASE; ++tb)
+    if (timebase_info[tb].available)
+      calibrate_timebase(tb, tb==timebase ? calib_sec : MIN(calib_sec, 0.05));
+}
+
+static void report_timebases() {
+  timebase_t tb;
+  for (tb=0; tb<NUM_TIMEBASE; ++tb) {
+    const struct timebase_info *info = &timebase_info[tb];
+    if (!info->available)
+      continue;
+    printf("# Timebase %-8s %c %14.1f ticks/sec", timebase_name[tb],
+           tb==timebase ? '*' : ' ', info->ticks_per_sec);
+    if (info->nominal_hz>0)
+      printf(" (nominal %.0f)", info->nominal_hz);
+    printf(", read %.1fns, resolution %.1fns\n", info->read_nsec, info->resolution_nsec);
+  }
+}
+
+
+// Helper threads must never win the CPU from the activity thread. They
+// also drop any real-time policy inherited from it.
+static void lower_thread_priority() {
+  struct sched_param param;
+  param.sched_priority = sched_get_priority_min(SCHED_OTHER);
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+#if defined(__linux__)
+  setpriority(PRIO_PROCESS, 0, 19); // nice is per-thread on Linux
+#endif
+}
+
+
+/****************************************************************************/
+// Real time
+//
+// --realtime runs the activity thread, and the workers that inherit from
+// it, under SCHED_FIFO (or SCHED_RR), locks all memory present and future,
+// and touches the stack so the run itself takes no page faults. Threads are
+// pinned to --cpus (CPU 0 by default) as always. getrusage() tells how well
+// that worked. The large static rings and the memory buffers are written
+// page by page before the first step with or without --realtime, since
+// mlockall() may fail (it needs privileges on Darwin) and then only warns.
+
+static int realtime = 0;
+static int rt_policy = SCHED_FIFO;
+static int rt_priority = 0;         // 0: one below the maximum
+static struct rusage run_usage;
+
+#define RT_STACK_PREFAULT (512*1024)
+
+static void prefault_stack() {
+  volatile char stack[RT_STACK_PREFAULT];
+  size_t i;
+  for (i=0; i<sizeof(stack); i+=1024)
+    stack[i] = 0;
+}
+
+// Writes one byte per page, so a zero-fill page is really allocated.
+static void prefault(void *p, size_t bytes) {
+  volatile char *c = p;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE), i;
+  for (i=0; i<bytes; i+=page)
+    c[i] = c[i];
+}
+
+static void go_realtime() {
+  struct sched_param param;
+  int err;
+  if (rt_priority==0)
+    rt_priority = sched_get_priority_max(rt_policy)-1;
+  param.sched_priority = rt_priority;
+  if ((err = pthread_setschedparam(pthread_self(), rt_policy, &param))!=0)
+    printf("# WARNING: cannot switch to %s priority %d: %s\n",
+           rt_policy==SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority, strerror(err));
+  else
+    printf("# Real time: %s priority %d\n", rt_policy==SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority);
+  if (mlockall(MCL_CURRENT|MCL_FUTURE)!=0)
+    printf("# WARNING: cannot lock memory: %s\n", strerror(errno));
+  prefault_stack();
+}
+
+static void start_usage() {
+  getrusage(RUSAGE_SELF, &run_usage);
+}
+
+static void report_usage() {
+  struct rusage end;
+  getrusage(RUSAGE_SELF, &end);
+  printf("# Run: %ld involuntary and %ld voluntary context switches, %ld minor and %ld major page faults\n",
+         end.ru_nivcsw-run_usage.ru_nivcsw, end.ru_nvcsw-run_usage.ru_nvcsw,
+         end.ru_minflt-run_usage.ru_minflt, end.ru_majflt-run_usage.ru_majflt);
+}
+
+
+/****************************************************************************/
+// Messages
+//
+// say() and note() run on the activity thread between steps, so they do not
+// format anything there. They scan the format for its conversions, copy the
+// arguments into a fixed-size record and push it into a single-producer
+// ring; a low-priority thread formats and prints it. The cost per message
+// is bounded by the length of the format and is measured. Arguments printed
+// with %s must stay valid until the message is printed (string literals,
+// activity names, schedule labels). Before start_say() and after
+// finish_say() messages are printed directly.
+
+#define SAY_RING_SIZE 1024   // messages, must be power of 2
+#define SAY_MAX_ARGS 8
+
+union say_arg {
+  long long i;
+  double d;
+  const void *p;
+};
+
+struct say_record {
+  tick_t stamp;
+  const char *format;
+  int stamped;
+  int nargs;
+  union say_arg args[SAY_MAX_ARGS];
+};
+
+static struct say_record say_ring[SAY_RING_SIZE];
+static _Alignas(64) atomic_ulong say_head;
+static _Alignas(64) atomic_ulong say_tail;
+static _Alignas(64) unsigned long say_count, say_dropped;
+static tick_t say_ticks, say_max_ticks;
+static atomic_int say_running;
+static atomic_int say_stop;
+static pthread_t say_thread;
+static tick_t say_anchor_tick;
+static musec_t say_anchor_musec;
+
+// Copies the arguments the format consumes. Only the conversions
+// printf() users here need are understood: no '*' widths, no long double.
+static int say_collect(const char *format, va_list ap, union say_arg *args) {
+  const char *p;
+  int n = 0, longs;
+  for (p=format; *p && n<SAY_MAX_ARGS; ++p) {
+    if (*p!='%')
+      continue;
+    if (*++p=='%')
+      continue;
+    while (*p=='-' || *p=='+' || *p==' ' || *p=='#' || *p=='0' || *p=='.' || (*p>='1' && *p<='9'))
+      ++p;
+    for (longs=0; *p=='l' || *p=='h' || *p=='z' || *p=='j' || *p=='t'; ++p)
+      longs += (*p!='h');
+    switch (*p) {
+    case 'd': case 'i':
+      args[n++].i = longs>1 ? va_arg(ap, long long) : longs ? va_arg(ap, long) : va_arg(ap, int);
+      break;
+    case 'u': case 'x': case 'X': case 'o': case 'c':
+      args[n++].i = longs>1 ? va_arg(ap, unsigned long long) : longs ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      args[n++].d = va_arg(ap, double);
+      break;
+    case 's': case 'p':
+      args[n++].p = va_arg(ap, const void *);
+      break;
+    case '\0':
+      return n;
+    }
+  }
+  return n;
+}
+
+// The inverse of say_collect(): print each conversion with its argument.
+static void say_print(FILE *out, const struct say_record *rec) {
+  const char *p, *spec;
+  char conv[32];
+  int n = 0;
+  if (rec->stamped) {
+    musec_t stamp = say_anchor_musec + (musec_t)((rec->stamp-say_anchor_tick)*1e6/ticks_per_sec) - start_musec;
+    fprintf(out, "%lld.%06lld: ", stamp/MUSEC_SEC, stamp%MUSEC_SEC);
+  } else {
+    fputs("# ", out);
+  }
+  for (p=rec->format; *p; ++p) {
+    if (*p!='%' || n>=rec->nargs) {
+      if (*p=='%' && p[1]=='%')
+        ++p;
+      fputc(*p, out);
+      continue;
+    }
+    if (p[1]=='%') {
+      fputc(*++p, out);
+      continue;
+    }
+    spec = p++;
+    while (*p && !strchr("diuxXocfFeEgGaAsp", *p))
+      ++p;
+    if (!*p || p-spec+4 > (long)sizeof(conv))
+      break;
+    memcpy(conv, spec, p-spec+1);
+    conv[p-spec+1] = '\0';
+    switch (*p) {
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      fprintf(out, conv, rec->args[n].d);
+      break;
+    case 's': case 'p':
+      fprintf(out, conv, rec->args[n].p);
+      break;
+    case 'c':
+      fputc((int)rec->args[n].i, out);
+      break;
+    default: {
+      // Stored as long long, whatever the length modifier said.
+      size_t len = p-spec;
+      while (len>1 && strchr("lhzjt", spec[len-1]))
+        --len;
+      memcpy(conv+len, "ll", 2);
+      conv[len+2] = *p;
+      conv[len+3] = '\0';
+      fprintf(out, conv, rec->args[n].i);
+      break;
+    }
+    }
+    ++n;
+  }
+  fputc('\n', out);
+}
+
+static void say_push(int stamped, const char *format, va_list ap) {
+  struct say_record rec;
+  tick_t now, done;
+  unsigned long head;
+  rdtscll(now);
+  rec.stamp = now;
+  rec.format = format;
+  rec.stamped = stamped;
+  rec.nargs = say_collect(format, ap, rec.args);
+  if (!atomic_load_explicit(&say_running, memory_order_relaxed)) {
+    say_anchor_tick = now;
+    say_anchor_musec = get_time_musec();
+    say_print(stdout, &rec);
+    return;
+  }
+  head = atomic_load_explicit(&say_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&say_tail, memory_order_acquire) >= SAY_RING_SIZE) {
+    ++say_dropped;
+  } else {
+    say_ring[head & (SAY_RING_SIZE-1)] = rec;
+    atomic_store_explicit(&say_head, head+1, memory_order_release);
+  }
+  rdtscll(done);
+  ++say_count;
+  say_ticks += done-now;
+  say_max_ticks = MAX(say_max_ticks, done-now);
+}
+
+// A time-stamped progress message, shown with -v.
+void say(const char *format, ...) {
+  if (verbose) {
+    va_list ap;
+    va_start(ap, format);
+    say_push(1, format, ap);
+    va_end(ap);
+  }
+}
+
+// A "# " comment line, shown with -v.
+void note(const char *format, ...) {
+  if (verbose) {
+    va_list ap;
+    va_start(ap, format);
+    say_push(0, format, ap);
+    va_end(ap);
+  }
+}
+
+static void drain_say() {
+  unsigned long tail = atomic_load_explicit(&say_tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&say_head, memory_order_acquire);
+  for (; tail!=head; ++tail) {
+    say_print(stdout, &say_ring[tail & (SAY_RING_SIZE-1)]);
+    atomic_store_explicit(&say_tail, tail+1, memory_order_release);
+  }
+  fflush(stdout);
+}
+
+static void *say_printer(void *arg) {
+  struct timespec poll = {0, 1000000};
+  lower_thread_priority();
+  while (!atomic_load(&say_stop)) {
+    drain_say();
+    nanosleep(&poll, NULL);
+  }
+  drain_say();
+  return NULL;
+}
+
+static void start_say() {
+  rdtscll(say_anchor_tick);
+  say_anchor_musec = get_time_musec();
+  fflush(stdout);
+  if (pthread_create(&say_thread, NULL, say_printer, NULL)!=0)
+    error("Cannot start message thread");
+  atomic_store(&say_running, 1);
+}
+
+// Prints whatever is queued; later messages are printed directly.
+static void finish_say() {
+  if (!atomic_exchange(&say_running, 0))
+    return;
+  atomic_store(&say_stop, 1);
+  pthread_join(say_thread, NULL);
+  if (verbose && say_count>0)
+    printf("# say(): %lu messages, mean %.0fns, max %.0fns on the activity thread, %lu dropped\n",
+           say_count, 1e9*say_ticks/say_count/ticks_per_sec, 1e9*say_max_ticks/ticks_per_sec, say_dropped);
+}
+
+
 /****************************************************************************/
 // Shouting
+//
+// With -s or --shout SINK every step plays its activity's tone, so that a
+// recording of the emanation can be lined up with what ran. The tones are
+// one-second tables in shout_bufs, made before the run. The activity thread
+// only posts "activity changed at tick T" into a single-producer ring. A
+// feeder thread renders the audio SHOUT_LAG_MSEC behind real time,
+// switching tables at the sample that matches T, and hands it to a sink:
+//
+//   null          render and discard
+//   wav:FILE      a 16-bit mono WAV file
+//   raw:FILE      raw 16-bit host-endian PCM, e.g. into a FIFO
+//   pipe:COMMAND  the same into a command, e.g. "aplay -f S16_LE"
+//   alsa[:PCM]    ALSA playback, when built with -DRATTLE_ALSA -lasound
+//
+// -s alone means alsa where it is built in, else wav:rattle-shout.wav.
+// -f and -F raise the sample rate from 8kHz to 48kHz or 96kHz.
 
-#define DSP_FILENAME "/dev/dsp"
-#define DSP_FORMAT_T signed short // signed char
-#define DSP_FORMAT_AFMT AFMT_S16_LE // AFMT_S8
+#define DSP_FORMAT_T signed short
 #define DSP_FORMAT_UNSIGNED 0
-#define SHOUT_BUF_SEC 1/1
-static int dsp_channels = 1;
-static int dsp_freq = 8000;
-
 #define DSP_FORMAT_RANGE ((1<<(sizeof(DSP_FORMAT_T)*8))-1)
 #define FLOAT_TO_SAMPLE(x) ((DSP_FORMAT_T)( ((x)+DSP_FORMAT_UNSIGNED)/2*DSP_FORMAT_RANGE ))
-static int dsp_fd = -1;
-static int shout_buf_cur_sample = 0;
-static int shout_samples_pending = 0;
-static activity_t shout_activity = A_NONE;
-static int dsp_buf_bytes = -1; // OSS's buffer in bytes
-static musec_t dsp_buf_musec = -1; // .. and in microseconds.
-static musec_t dsp_refill_musec = -1;
-static tick_t dsp_refill_ticks = -1;
-static int shout_buf_bytes = -1;
-static int shout_buf_samples = -1;
-static DSP_FORMAT_T *(shout_bufs[NUM_ACTIVITY]);
+#define SHOUT_RING_SIZE 1024        // events, must be power of 2
+#define SHOUT_LAG_MSEC 50
+#define SHOUT_CHUNK_FRAMES 512
+#define SHOUT_SILENCE NUM_ACTIVITY  // shout() this for quiet
+#if defined(RATTLE_ALSA)
+#define SHOUT_DEFAULT_SINK "alsa"
+#else
+#define SHOUT_DEFAULT_SINK "wav:rattle-shout.wav"
+#endif
+
+struct shout_event {
+  tick_t tick;
+  int act;                          // activity_t or SHOUT_SILENCE
+};
+
+struct shout_sink {
+  const char *prefix;
+  int needs_arg;
+  void (*open)(const char *arg);
+  void (*write)(const DSP_FORMAT_T *frames, int count);
+  void (*close)();
+};
+
+static int dsp_channels = 1;
+static int dsp_freq = 8000;
+static const char *shout_spec = NULL;
+static const struct shout_sink *shout_sink;
+static FILE *shout_file;
+static long long shout_bytes;
+static DSP_FORMAT_T *shout_bufs[NUM_ACTIVITY+1];
+static int shout_buf_samples;       // frames per table
 
+static struct shout_event shout_ring[SHOUT_RING_SIZE];
+static _Alignas(64) atomic_ulong shout_head;
+static _Alignas(64) atomic_ulong shout_tail;
+static _Alignas(64) unsigned long shout_dropped;
+static atomic_int shout_stop;
+static pthread_t shout_thread;
 
 // Returns a normally distributed deviate with zero mean and unit variance.
 // Based on gasdev() from Numerical Recipes in C.
@@ -189,246 +793,1419 @@ float gaussian_random() {
   }
 }
 
-//static void set_dsp_format() {
-//  int i;
-//  audio_buf_info info;
-//
-//  i = DSP_FORMAT_AFMT;
-//  if (ioctl(dsp_fd, SNDCTL_DSP_SETFMT, &i)<0 || i!=DSP_FORMAT_AFMT)
-//    error("SNDCTL_DSP_SETFMT failed: %s", strerror(errno));
-//
-//  --dsp_channels;
-//  if (ioctl(dsp_fd, SNDCTL_DSP_STEREO, &dsp_channels)<0)
-//    error("SNDCTL_DSP_STEREO failed: %s", strerror(errno));
-//  ++dsp_channels;
-//
-//  if (ioctl(dsp_fd, SNDCTL_DSP_SPEED, &dsp_freq)<0)
-//    error("SNDCTL_DSP_SPEED failed: %s", strerror(errno));
-//
-//  if (ioctl(dsp_fd, SNDCTL_DSP_GETOSPACE, &info)<0)
-//    error("SNDCTL_DSP_GETOSPACE failed: %s\n", strerror(errno));
-//
-//  dsp_buf_bytes = MIN(info.bytes, info.fragstotal*info.fragsize);
-//  dsp_buf_musec = dsp_buf_bytes*MUSEC_SEC/(sizeof(DSP_FORMAT_T)*dsp_channels*dsp_freq);
-//  dsp_refill_musec = dsp_buf_musec * 9/10;
-//  dsp_refill_ticks = dsp_refill_musec*ticks_per_sec/MUSEC_SEC;
-//  printf("* Using %d audio channel(s) at %dHz, %dbit.\n* OSS buffer is %d*%d=%d bytes, can write %d (hence: %fsec).\n* Will refill every %fsec.\n", dsp_channels, dsp_freq, (int)sizeof(DSP_FORMAT_T)*8, info.fragstotal, info.fragsize, info.fragstotal*info.fragsize, info.bytes, 1.0*dsp_buf_musec/MUSEC_SEC, 1.0*dsp_refill_musec/MUSEC_SEC);
-//}
-
-//static void init_shouting() {
-//  int a, i, j;
-//  if (!shouting)
-//    return;
-//  dsp_fd = open(DSP_FILENAME, O_WRONLY | O_NONBLOCK);
-//  if (dsp_fd<0)
-//    error("Cannot open %s: %s", DSP_FILENAME, strerror(errno));
-//  // Default format is 8-bit unsigned mono 8KHz */
-//
-//  set_dsp_format();
-//  shout_buf_samples = dsp_freq * dsp_channels * SHOUT_BUF_SEC;
-//  shout_buf_bytes = shout_buf_samples * (dsp_channels*sizeof(DSP_FORMAT_T));
-//  printf("* Shouting uses buffers of %d samples (%d bytes)\n", shout_buf_samples, shout_buf_bytes);
-//
-//  for (a=0; a<NUM_ACTIVITY; ++a) {
-//    if ((shout_bufs[a] = (DSP_FORMAT_T*)malloc(shout_buf_bytes))==NULL)
-//      error("init_shouting: malloc failed");
-//    for (i=0; i<shout_buf_samples; ++i) {
-//      for (j=0; j<dsp_channels; ++j) {
-//    double k = 1.0/dsp_freq * activity_shout_freq[a]*pow(2,SHOUT_OCTAVE) * 2*M_PI;
-//    shout_bufs[a][i*dsp_channels+j] = FLOAT_TO_SAMPLE(0.95*sin(i*k));
-//      }
-//    }
-//  }
-//  for (i=0; i<shout_buf_samples; ++i) {
-//    for (j=0; j<dsp_channels; ++j) {
-//      shout_bufs[A_NONE][i*dsp_channels+j] = FLOAT_TO_SAMPLE( MIN(1,MAX(-1,gaussian_random()/3)) );
-//    }
-//  }
-//  printf("* Shouting buffers initialized (%d bytes total).\n", NUM_ACTIVITY*shout_buf_bytes);
-//}
-
-//static void crank_shouting() {
-//  if (!shouting || shout_samples_pending<=0)
-//    return;
-//  do {
-//    int bytes_to_write, bytes_written, samples_written, stop=0;
-//    if (shout_samples_pending <= 0)
-//      return;
-//    if (shout_buf_cur_sample>=shout_buf_samples)
-//      shout_buf_cur_sample = 0;
-//    bytes_to_write = MIN(shout_samples_pending, shout_buf_samples-shout_buf_cur_sample)
-//                     * sizeof(DSP_FORMAT_T) * dsp_channels;
-//
-//    audio_buf_info info;
-//    if (ioctl(dsp_fd, SNDCTL_DSP_GETOSPACE, &info)<0)
-//      error("SNDCTL_DSP_GETOSPACE failed: %s\n", strerror(errno));
-//    // info.bytes == #bytes that can be written without blocking
-//    if (info.bytes<bytes_to_write) {
-//      // printf("* Wanted to write %d bytes, room for only %d\n", bytes_to_write, info.bytes);
-//      stop=1;
-//      if (info.bytes==0)
-//    return;
-//      bytes_to_write = info.bytes;
-//    }
-//
-//    bytes_written = write(dsp_fd,
-//              shout_bufs[shout_activity] + shout_buf_cur_sample*dsp_channels,
-//              bytes_to_write);
-//    //printf("* %f: Wrote %d bytes starting at sample %d, act=%d\n", 1.0*(get_time_musec()-start_musec)/MUSEC_SEC, bytes_written, shout_buf_cur_sample, shout_activity);
-//    if (bytes_written<0) {
-//      if (errno==EAGAIN)
-//    return;
-//      else if (errno==EINTR)
-//    continue;
-//      else
-//    error("Error while cranking shouting: %s", strerror(errno));
-//    }
-//    assert(bytes_written==bytes_to_write);
-//    assert(bytes_written % (sizeof(DSP_FORMAT_T)*dsp_channels) == 0);
-//    samples_written = bytes_written/(sizeof(DSP_FORMAT_T)*dsp_channels);
-//    //printf("* crank_shouting: written=%d\n", written);
-//    shout_buf_cur_sample += samples_written;
-//    shout_samples_pending -= samples_written;
-//    if (stop)
-//      return;
-//  } while (shout_samples_pending>0);
-//  if (ioctl(dsp_fd, SNDCTL_DSP_POST, 0)<0)
-//    error("SNDCTL_DSP_POST failed: %s", strerror(errno));
-//}
-
-//static void start_shouting(activity_t act, float sec) {
-//  double max_sec;
-//  if (!shouting)
-//    return;
-//  assert(shout_activity==A_NONE);
-//  max_sec = (sec + 2.0*sleep_granularity/MUSEC_SEC) * 1.1; // avoid buffer underruns
-//  shout_samples_pending = (int)(dsp_freq*max_sec);
-//  shout_buf_cur_sample = 0; // eek!
-//  shout_activity = act;
-//  //printf("* shout: will play %d samples\n", shout_samples_pending);
-//  crank_shouting();
-//}
-//
-//static void stop_shouting() {
-//  if (!shouting)
-//    return;
-//  if (verbose && shout_samples_pending>0)
-//    printf("WARNING: when stopping activity #%d, %d shouting samples not yet written\n", shout_activity, shout_samples_pending);
-//  shout_activity=A_NONE;
-//  if (ioctl(dsp_fd, SNDCTL_DSP_RESET, 0)<0)
-//    error("SNDCTL_DSP_RESET failed: %s", strerror(errno));
-//    // Note: SNDCTL_DSP_RESET may forget format settings (and does on Cygwin)
-//  //printf("* quiet\n");
-//  //set_dsp_format(0);
-//}
+static void put_le(unsigned char *p, uint32_t value, int bytes) {
+  while (bytes-- > 0) {
+    *p++ = value & 0xff;
+    value >>= 8;
+  }
+}
 
+// Sizes are filled in by wav_close(), and stay zero if that never runs.
+static void wav_header(unsigned char *h, uint32_t data_bytes) {
+  memcpy(h, "RIFF", 4);
+  put_le(h+4, 36+data_bytes, 4);
+  memcpy(h+8, "WAVEfmt ", 8);
+  put_le(h+16, 16, 4);
+  put_le(h+20, 1, 2);                      // PCM
+  put_le(h+22, dsp_channels, 2);
+  put_le(h+24, dsp_freq, 4);
+  put_le(h+28, dsp_freq*dsp_channels*sizeof(DSP_FORMAT_T), 4);
+  put_le(h+32, dsp_channels*sizeof(DSP_FORMAT_T), 2);
+  put_le(h+34, 8*sizeof(DSP_FORMAT_T), 2);
+  memcpy(h+36, "data", 4);
+  put_le(h+40, data_bytes, 4);
+}
 
-/****************************************************************************/
-// Timing
+static void null_open(const char *arg) {}
+static void null_write(const DSP_FORMAT_T *frames, int count) {}
+static void null_close() {}
 
-#if defined(__arm64__)
-#define rdtscll(val) {\
-    struct timeval tv;\
-    if (gettimeofday(&tv, NULL)!=0)\
-      error("gettimeofday failed: %s", strerror(errno));\
-    val = tv.tv_sec*MUSEC_SEC + tv.tv_usec;\
-  }
-#elif defined(__i386__)
-#define rdtscll(val) asm volatile("rdtsc" : "=A" (val))
-#else
-#error "rdtsc not defined to this arch"
-#endif
+static void file_open(const char *arg) {
+  if ((shout_file = fopen(arg, "wb"))==NULL)
+    error("Cannot open %s: %s", arg, strerror(errno));
+}
 
-static inline musec_t get_time_musec() {
-  struct timeval tv;
-  if (gettimeofday(&tv, NULL)!=0)
-    error("gettimeofday failed: %s", strerror(errno));
-  return tv.tv_sec*MUSEC_SEC + tv.tv_usec;
+static void file_write(const DSP_FORMAT_T *frames, int count) {
+  size_t bytes = count*dsp_channels*sizeof(DSP_FORMAT_T);
+  if (fwrite(frames, 1, bytes, shout_file)!=bytes)
+    error("Cannot write audio: %s", strerror(errno));
+  shout_bytes += bytes;
 }
 
+static void file_close() {
+  fclose(shout_file);
+}
 
+static void wav_open(const char *arg) {
+  unsigned char h[44];
+  file_open(arg);
+  wav_header(h, 0);
+  fwrite(h, 1, sizeof(h), shout_file);
+}
 
-static int sand[SAND_SIZE];
+static void wav_close() {
+  unsigned char h[44];
+  wav_header(h, (uint32_t)MIN(shout_bytes, UINT32_MAX-36));
+  if (fseek(shout_file, 0, SEEK_SET)==0)
+    fwrite(h, 1, sizeof(h), shout_file);
+  fclose(shout_file);
+}
 
-#define DEFINE_LOOP(NAME,PRECODE,CODE) \
-static void loop_##NAME(tick_t end_tick) \
-{ \
-  tick_t now_tick; rdtscll(now_tick); \
-  PRECODE; \
-  while (now_tick < end_tick) { \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; CODE; \
-    rdtscll(now_tick); \
-  } \
-}  \
-static void perform_##NAME(float sec) { \
-  struct log_entry entry; tick_t first_tick, last_tick, next_tick; \
-  say(#NAME); entry.activity = #NAME;  \
-  if (spiking) spike(A_##NAME); \
-  rdtscll(first_tick); \
-  last_tick = first_tick + (tick_t)(ticks_per_sec*sec*slowdown); \
-  entry.start_musec = get_time_musec(); \
-  loop_##NAME(last_tick); \
-  entry.end_musec = get_time_musec(); \
-  tell_log(&entry); \
-}
-
-#if defined(__arm64__)
-DEFINE_LOOP(PAUSE, {},  asm volatile ("nop"));
-DEFINE_LOOP(ADD, {}, asm volatile ("add w0, w0, #0" : : : "w0") );
-DEFINE_LOOP(MUL, {}, asm volatile ("mul w0, w1, w2" : : : "w0", "w1", "w2") );
-#ifndef __ANDROID_API__
-//DEFINE_LOOP(FMUL, {}, asm volatile ("VMUL.F32 s14, s14, s15" : : : "s14", "s15") );
-//DEFINE_LOOP(MUL_FMUL, {}, asm volatile ("mul w0, w1, w2; VMUL.F32 s14, s14, s15" : : : "w0", "w1", "w2", "s14", "s15") );
+static void pipe_open(const char *arg) {
+  signal(SIGPIPE, SIG_IGN);  // a write error says it instead
+  if ((shout_file = popen(arg, "w"))==NULL)
+    error("Cannot run %s: %s", arg, strerror(errno));
+}
+
+static void pipe_close() {
+  pclose(shout_file);
+}
+
+#if defined(RATTLE_ALSA)
+static snd_pcm_t *shout_pcm;
+
+static void alsa_open(const char *arg) {
+  int err = snd_pcm_open(&shout_pcm, *arg ? arg : "default", SND_PCM_STREAM_PLAYBACK, 0);
+  if (err==0)
+    err = snd_pcm_set_params(shout_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+                             dsp_channels, dsp_freq, 1, 2*SHOUT_LAG_MSEC*1000);
+  if (err<0)
+    error("Cannot open ALSA device %s: %s", *arg ? arg : "default", snd_strerror(err));
+}
+
+static void alsa_write(const DSP_FORMAT_T *frames, int count) {
+  while (count>0) {
+    snd_pcm_sframes_t n = snd_pcm_writei(shout_pcm, frames, count);
+    if (n<0 && (n = snd_pcm_recover(shout_pcm, n, 1))<0)
+      error("ALSA write failed: %s", snd_strerror(n));
+    frames += n*dsp_channels;
+    count -= n;
+  }
+}
+
+static void alsa_close() {
+  snd_pcm_drain(shout_pcm);
+  snd_pcm_close(shout_pcm);
+}
 #endif
-#elif defined(__i386__)
-DEFINE_LOOP(PAUSE, {},  asm volatile ("rep;nop"));
-DEFINE_LOOP(ADD, {}, asm volatile ("addl $0, %%eax" : : : "eax") );
-DEFINE_LOOP(MUL, {}, asm volatile ("mull %%edx" : : : "eax", "edx") );
-DEFINE_LOOP(FMUL, {}, asm volatile ("fmulp") );
-DEFINE_LOOP(MUL_FMUL, {}, asm volatile ("mull %%edx; fmulp" : : : "eax", "edx") );
-#else
-#error "loops not defined for this arch"
+
+static const struct shout_sink shout_sinks[] = {
+  {"null", 0, null_open, null_write, null_close},
+  {"wav", 1, wav_open, file_write, wav_close},
+  {"raw", 1, file_open, file_write, file_close},
+  {"pipe", 1, pipe_open, file_write, pipe_close},
+#if defined(RATTLE_ALSA)
+  {"alsa", 0, alsa_open, alsa_write, alsa_close},
 #endif
-DEFINE_LOOP(MEMORY, static long i=0; volatile int x, i = (i+257) & (SAND_SIZE-1); x = sand[i]; );
-DEFINE_LOOP(DIV2, volatile int y=2; volatile int res, res = 0x77777777/y );
-DEFINE_LOOP(DIV8209, volatile int y=2; volatile int res, res = 0x77777777/y );
-DEFINE_LOOP(MEMW0, static long i=0, sand[i+3]=sand[i+2]=sand[i+1]=sand[i]= 0; i = (i+4) & (SAND_SIZE-1); );
-DEFINE_LOOP(MEMW1, static long i=0, sand[i+3]=sand[i+2]=sand[i+1]=sand[i]=-1; i = (i+4) & (SAND_SIZE-1); );
+};
+
+// Posts an activity change at the given tick; costs a ring store.
+static inline void shout(int act, tick_t tick) {
+  unsigned long head;
+  if (!shouting)
+    return;
+  head = atomic_load_explicit(&shout_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&shout_tail, memory_order_acquire) >= SHOUT_RING_SIZE) {
+    ++shout_dropped;
+    return;
+  }
+  shout_ring[head & (SHOUT_RING_SIZE-1)].tick = tick;
+  shout_ring[head & (SHOUT_RING_SIZE-1)].act = act;
+  atomic_store_explicit(&shout_head, head+1, memory_order_release);
+}
 
+// The tone of every activity at SHOUT_OCTAVE octaves above its note, white
+// noise for A_NONE (--whitenoise), and silence.
+static void init_shout_tables() {
+  int a, i, j;
+  shout_buf_samples = dsp_freq;
+  for (a=0; a<=NUM_ACTIVITY; ++a) {
+    double k = a<NUM_ACTIVITY ? 1.0/dsp_freq * activity_shout_freq[a]*pow(2,SHOUT_OCTAVE) * 2*M_PI : 0;
+    if ((shout_bufs[a] = calloc(shout_buf_samples*dsp_channels, sizeof(DSP_FORMAT_T)))==NULL)
+      error("init_shout_tables: calloc failed");
+    for (i=0; i<shout_buf_samples; ++i)
+      for (j=0; j<dsp_channels; ++j)
+        shout_bufs[a][i*dsp_channels+j] = a==A_NONE ? FLOAT_TO_SAMPLE( MIN(1,MAX(-1,gaussian_random()/3)) )
+                                                    : FLOAT_TO_SAMPLE(0.95*sin(i*k));
+  }
+}
 
-static long long get_ticks_per_sec(float calib_sec) {
-  tick_t i=1;
-  long long start_micro, end_micro;
-  long long start_tick;
-  printf("# Calibrating (%f)\n", calib_sec);
+// Frame origin is the tick the feeder started at. Tables are read at the
+// frame number modulo their length, so tones keep their phase.
+static void *shout_feeder(void *arg) {
+  DSP_FORMAT_T chunk[SHOUT_CHUNK_FRAMES*2];
+  struct timespec poll = {0, 5000000};
+  tick_t origin, now;
+  long long frame = 0, last, next_frame = INT64_MAX;
+  const struct shout_event *next = NULL;
+  int act = SHOUT_SILENCE, stopping, n, i, j;
+  lower_thread_priority();
+  rdtscll(origin);
   do {
-    i *= 2;
-    start_micro = get_time_musec();
-    rdtscll(start_tick);
-    loop_PAUSE(start_tick+i);
-    end_micro = get_time_musec();
-  } while (end_micro-start_micro < calib_sec*MUSEC_SEC);
-  printf("# Done\n");
-  return i*1000000L/(end_micro-start_micro);
+    stopping = atomic_load(&shout_stop);
+    rdtscll(now);
+    if (!stopping)
+      now -= SHOUT_LAG_MSEC*ticks_per_sec/1000;
+    last = (long long)((now-origin)*(double)dsp_freq/ticks_per_sec);
+    while (frame<last) {
+      n = (int)MIN(SHOUT_CHUNK_FRAMES, last-frame);
+      for (i=0; i<n; ++i, ++frame) {
+        while (1) {
+          if (next==NULL) {
+            unsigned long tail = atomic_load_explicit(&shout_tail, memory_order_relaxed);
+            if (tail==atomic_load_explicit(&shout_head, memory_order_acquire))
+              break;
+            next = &shout_ring[tail & (SHOUT_RING_SIZE-1)];
+            next_frame = (long long)((next->tick-origin)*(double)dsp_freq/ticks_per_sec);
+          }
+          if (next_frame>frame)
+            break;
+          act = next->act;
+          next = NULL;
+          next_frame = INT64_MAX;
+          atomic_fetch_add_explicit(&shout_tail, 1, memory_order_release);
+        }
+        for (j=0; j<dsp_channels; ++j)
+          chunk[i*dsp_channels+j] = shout_bufs[act][(frame%shout_buf_samples)*dsp_channels+j];
+      }
+      shout_sink->write(chunk, n);
+    }
+    if (!stopping)
+      nanosleep(&poll, NULL);
+  } while (!stopping);
+  return NULL;
 }
 
-static void coarse_sleep(musec_t total_musec, musec_t *start_musec, musec_t *end_musec) {
-  musec_t start = get_time_musec();
-  musec_t current = start;
-  musec_t end = start+total_musec;
+static void start_shouting() {
+  const char *spec = shout_spec ? shout_spec : SHOUT_DEFAULT_SINK;
+  size_t len = strcspn(spec, ":");
+  unsigned int s;
+  if (!shouting)
+    return;
+  for (s=0; s<sizeof(shout_sinks)/sizeof(shout_sinks[0]); ++s)
+    if (strlen(shout_sinks[s].prefix)==len && strncmp(spec, shout_sinks[s].prefix, len)==0)
+      break;
+  if (s==sizeof(shout_sinks)/sizeof(shout_sinks[0]))
+    error("Unknown or unsupported --shout sink: %s", spec);
+  shout_sink = &shout_sinks[s];
+  if (shout_sink->needs_arg && (spec[len]!=':' || spec[len+1]=='\0'))
+    error("--shout %s needs a name: %s:...", shout_sink->prefix, shout_sink->prefix);
+  init_shout_tables();
+  shout_sink->open(spec[len]==':' ? spec+len+1 : "");
+  printf("# Shouting to %s at %dHz\n", spec, dsp_freq);
+  if (pthread_create(&shout_thread, NULL, shout_feeder, NULL)!=0)
+    error("Cannot start audio feeder thread");
+}
+
+// Renders up to now, then closes the sink.
+static void finish_shouting() {
+  tick_t now;
+  if (!shouting)
+    return;
+  rdtscll(now);
+  shout(SHOUT_SILENCE, now);
+  atomic_store(&shout_stop, 1);
+  pthread_join(shout_thread, NULL);
+  shout_sink->close();
+  if (shout_dropped>0)
+    printf("# WARNING: %lu shouting events dropped\n", shout_dropped);
+}
+
+
+/****************************************************************************/
+// Activity log
+//
+// tell_log() pushes entries into a single-producer ring that a writer thread
+// drains into a memory-mapped binary log (see rattle-log.h). The activity
+// thread never blocks and never makes a system call; if the writer cannot
+// keep up, entries are dropped and counted. Without --log the log goes to an
+// anonymous temporary file, which dump_log() converts to the usual "> "
+// lines at the end of the run; --log2text does the same for a saved log.
+
+#define LOG_RING_SIZE 65536           // entries, must be power of 2
+#define LOG_MAP_CHUNK (4*1024*1024)   // bytes mapped at a time
+#define LOG_MAX_NAMES 4096
+#define LOG_NAME_HASH (2*LOG_MAX_NAMES)  // slots, must be power of 2
+
+#define LOG_CORES_RING_SIZE 4096     // per-core records, must be power of 2
+#define LOG_SIDE_RING_SIZE 256       // samples and corrections, must be power of 2
+#define LOG_EDGE_RING_SIZE (1<<20)   // chirp transitions, must be power of 2
+
+static struct log_entry log_ring[LOG_RING_SIZE];
+static _Alignas(64) atomic_ulong log_head;  // written by the activity thread
+static _Alignas(64) atomic_ulong log_tail;  // written by the writer thread
+static struct log_cores log_cores_ring[LOG_CORES_RING_SIZE];
+static _Alignas(64) atomic_ulong log_cores_head;
+static _Alignas(64) atomic_ulong log_cores_tail;
+static struct log_perf log_perf_ring[LOG_CORES_RING_SIZE];
+static _Alignas(64) atomic_ulong log_perf_head;
+static _Alignas(64) atomic_ulong log_perf_tail;
+static const struct log_sequence *log_sequence_ring[LOG_SIDE_RING_SIZE];  // from the schedule
+static _Alignas(64) atomic_ulong log_sequence_head;
+static _Alignas(64) atomic_ulong log_sequence_tail;
+static struct log_sample log_sample_ring[LOG_SIDE_RING_SIZE];  // from the monitor thread
+static _Alignas(64) atomic_ulong log_sample_head;
+static _Alignas(64) atomic_ulong log_sample_tail;
+static struct log_correction log_correction_ring[LOG_SIDE_RING_SIZE];  // from the activity thread
+static _Alignas(64) atomic_ulong log_correction_head;
+static _Alignas(64) atomic_ulong log_correction_tail;
+static int32_t log_edge_ring[LOG_EDGE_RING_SIZE];  // lateness in ticks
+static _Alignas(64) atomic_ulong log_edge_head;
+static _Alignas(64) atomic_ulong log_edge_tail;
+static _Alignas(64) unsigned long log_dropped;
+static unsigned long log_edges_dropped;     // transitions not recorded
+static atomic_int log_stop;
+static pthread_t log_thread;
+
+static int log_fd = -1;
+static char *log_map = NULL;         // current window into the file
+static off_t log_map_offset = 0;     // file offset of log_map
+static off_t log_pos = 0;            // next byte to write
+static unsigned long log_written = 0;
+static const char *log_names[LOG_MAX_NAMES];  // copies, so schedules can be freed
+static unsigned int log_num_names = 0;
+static unsigned int log_name_slot[LOG_NAME_HASH];  // id+1, 0: empty
+
+static void tell_log(const struct log_entry *entry) {
+  unsigned long head = atomic_load_explicit(&log_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_tail, memory_order_acquire) >= LOG_RING_SIZE) {
+    ++log_dropped;
+    return;
+  }
+  log_ring[head & (LOG_RING_SIZE-1)] = *entry;
+  atomic_store_explicit(&log_head, head+1, memory_order_release);
+}
+
+// Per-core timings go through a ring of their own, so that single-core runs
+// do not pay for their size in every entry. Push them before the entry they
+// belong to and set entry->cores only if this returned true.
+static int tell_log_cores(const struct log_cores *cores) {
+  unsigned long head = atomic_load_explicit(&log_cores_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_cores_tail, memory_order_acquire) >= LOG_CORES_RING_SIZE)
+    return 0;
+  log_cores_ring[head & (LOG_CORES_RING_SIZE-1)] = *cores;
+  atomic_store_explicit(&log_cores_head, head+1, memory_order_release);
+  return 1;
+}
+
+// Counter deltas work like per-core timings
+static int tell_log_perf(const struct log_perf *perf) {
+  unsigned long head = atomic_load_explicit(&log_perf_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_perf_tail, memory_order_acquire) >= LOG_CORES_RING_SIZE)
+    return 0;
+  log_perf_ring[head & (LOG_CORES_RING_SIZE-1)] = *perf;
+  atomic_store_explicit(&log_perf_head, head+1, memory_order_release);
+  return 1;
+}
+
+// A step records its transitions straight into the edge ring, from the
+// position this returns, then publishes them with tell_log_edges(). It does
+// so a block at a time, so the writer drains the ring while a long chirp
+// runs. -1 if the block does not fit.
+static long reserve_log_edges(int n) {
+  unsigned long head = atomic_load_explicit(&log_edge_head, memory_order_relaxed);
+  if (head + n - atomic_load_explicit(&log_edge_tail, memory_order_acquire) > LOG_EDGE_RING_SIZE)
+    return -1;
+  return (long)head;
+}
+
+static inline void record_edge(long head, int k, tick_t late) {
+  log_edge_ring[(head+k) & (LOG_EDGE_RING_SIZE-1)] = (int32_t)MAX(MIN(late, INT32_MAX), INT32_MIN);
+}
+
+static void tell_log_edges(int n) {
+  atomic_fetch_add_explicit(&log_edge_head, n, memory_order_release);
+}
+
+// Start lateness and end overshoot per step name, in log-linear buckets:
+// values below HIST_SUB nanoseconds are exact, and every power of two above
+// is split into HIST_SUB buckets, so percentiles are within 1/HIST_SUB.
+// The writer thread keeps them for SIGUSR1; convert_log() rebuilds them
+// from the file.
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS ((40-HIST_SUB_BITS+1)*HIST_SUB) // up to 2^40ns, about 18 minutes
+
+struct hist {
+  unsigned long long count;
+  long long max;
+  unsigned int bucket[HIST_BUCKETS];
+};
+
+struct timing {
+  struct hist late, over;
+};
+
+static void hist_add(struct hist *h, long long nsec) {
+  unsigned long long v = nsec>0 ? nsec : 0;
+  int b = v;
+  if (v>=HIST_SUB) {
+    int shift = 63-__builtin_clzll(v) - HIST_SUB_BITS;
+    b = MIN((shift+1)*HIST_SUB + (int)(v>>shift) - HIST_SUB, HIST_BUCKETS-1);
+  }
+  ++h->bucket[b];
+  h->max = h->count++ ? MAX(h->max, nsec) : nsec;
+}
+
+// Lower bound of the bucket holding the given fraction of the values
+static long long hist_quantile(const struct hist *h, double q) {
+  unsigned long long want = (unsigned long long)(q*h->count), seen = 0;
+  int b;
+  for (b=0; b<HIST_BUCKETS-1; ++b)
+    if ((seen += h->bucket[b]) > want)
+      break;
+  return b<HIST_SUB ? b : (long long)(b%HIST_SUB + HIST_SUB) << (b/HIST_SUB - 1);
+}
+
+static struct timing *add_timing(struct timing **timings, unsigned int id, long long late_nsec, long long over_nsec) {
+  if (timings[id]==NULL && (timings[id] = calloc(1, sizeof(struct timing)))==NULL)
+    error("add_timing: calloc failed");
+  hist_add(&timings[id]->late, late_nsec);
+  hist_add(&timings[id]->over, over_nsec);
+  return timings[id];
+}
+
+static void report_timing(FILE *out, struct timing *const *timings, const char *const *names, unsigned int num_names) {
+  unsigned int i;
+  int header = 0;
+  for (i=0; i<num_names; ++i) {
+    const struct timing *t = timings[i];
+    if (t==NULL)
+      continue;
+    if (!header++)
+      fprintf(out, "# %-12s %7s  %-34s  %s\n", "Timing (us)", "steps",
+              "late: p50, p99, p99.9, max", "overshoot: p50, p99, p99.9, max");
+    fprintf(out, "# %-12s %7llu  %7.1f %7.1f %7.1f %9.1f    %7.1f %7.1f %7.1f %9.1f\n", names[i], t->late.count,
+           hist_quantile(&t->late, 0.5)/1000.0, hist_quantile(&t->late, 0.99)/1000.0,
+           hist_quantile(&t->late, 0.999)/1000.0, t->late.max/1000.0,
+           hist_quantile(&t->over, 0.5)/1000.0, hist_quantile(&t->over, 0.99)/1000.0,
+           hist_quantile(&t->over, 0.999)/1000.0, t->over.max/1000.0);
+  }
+}
+
+// Hardware counter totals per step name, from RLOG_PERF records. A counter
+// is only summed over steps that had it.
+struct perf_sum {
+  unsigned long long steps[RLOG_PERF_COUNTERS];
+  long long sum[RLOG_PERF_COUNTERS];
+};
+
+static void add_perf(struct perf_sum **sums, unsigned int id, const int64_t *delta, unsigned int counters) {
+  unsigned int c;
+  if (sums[id]==NULL && (sums[id] = calloc(1, sizeof(struct perf_sum)))==NULL)
+    error("add_perf: calloc failed");
+  for (c=0; c<MIN(counters, RLOG_PERF_COUNTERS); ++c) {
+    if (delta[c]==RLOG_PERF_MISSING)
+      continue;
+    ++sums[id]->steps[c];
+    sums[id]->sum[c] += delta[c];
+  }
+}
+
+// Ratio of two counters over the steps that had both, or NAN
+static double perf_ratio(const struct perf_sum *s, int num, int den, double scale) {
+  if (s->steps[num]==0 || s->steps[num]!=s->steps[den] || s->sum[den]<=0)
+    return NAN;
+  return scale*s->sum[num]/s->sum[den];
+}
+
+static void report_perf(struct perf_sum *const *sums, const char *const *names, unsigned int num_names) {
+  unsigned int i;
+  int header = 0;
+  for (i=0; i<num_names; ++i) {
+    const struct perf_sum *s = sums[i];
+    if (s==NULL)
+      continue;
+    if (!header++)
+      printf("# %-12s %7s  %7s %9s %9s %8s\n", "Counters", "steps",
+             "IPC", "LLC/kins", "bmiss/kins", "stall%");
+    printf("# %-12s %7llu  %7.3f %9.3f %9.3f %8.1f\n", names[i], s->steps[RLOG_PERF_CYCLES],
+           perf_ratio(s, RLOG_PERF_INSTRUCTIONS, RLOG_PERF_CYCLES, 1),
+           perf_ratio(s, RLOG_PERF_LLC_MISSES, RLOG_PERF_INSTRUCTIONS, 1000),
+           perf_ratio(s, RLOG_PERF_BRANCH_MISSES, RLOG_PERF_INSTRUCTIONS, 1000),
+           perf_ratio(s, RLOG_PERF_STALLED_BACKEND, RLOG_PERF_CYCLES, 100));
+  }
+}
+
+static struct timing *log_timings[LOG_MAX_NAMES];
+static volatile sig_atomic_t log_report_requested = 0;
+static _Atomic(FILE *) log_report_out;  // --control: print the report there
+static atomic_int log_flush_requested;  // --control: sync the file
+
+static void request_log_report(int sig) {
+  log_report_requested = 1;
+}
+
+// Samples and corrections are rare and may be dropped without counting.
+static void tell_log_sample(const struct log_sample *sample) {
+  unsigned long head = atomic_load_explicit(&log_sample_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_sample_tail, memory_order_acquire) >= LOG_SIDE_RING_SIZE)
+    return;
+  log_sample_ring[head & (LOG_SIDE_RING_SIZE-1)] = *sample;
+  atomic_store_explicit(&log_sample_head, head+1, memory_order_release);
+}
+
+static void tell_log_correction(const struct log_correction *correction) {
+  unsigned long head = atomic_load_explicit(&log_correction_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_correction_tail, memory_order_acquire) >= LOG_SIDE_RING_SIZE)
+    return;
+  log_correction_ring[head & (LOG_SIDE_RING_SIZE-1)] = *correction;
+  atomic_store_explicit(&log_correction_head, head+1, memory_order_release);
+}
+
+static void tell_log_sequence(const struct log_sequence *sequence) {
+  unsigned long head = atomic_load_explicit(&log_sequence_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&log_sequence_tail, memory_order_acquire) >= LOG_SIDE_RING_SIZE)
+    return;
+  log_sequence_ring[head & (LOG_SIDE_RING_SIZE-1)] = sequence;
+  atomic_store_explicit(&log_sequence_head, head+1, memory_order_release);
+}
+
+// Returns space for a record of the given size at the write position,
+// growing the file and sliding the mapped window as needed.
+static void *log_reserve(size_t size) {
+  long page = sysconf(_SC_PAGESIZE);
+  void *p;
+  if (log_map==NULL || log_pos+(off_t)size > log_map_offset+LOG_MAP_CHUNK) {
+    if (log_map!=NULL)
+      munmap(log_map, LOG_MAP_CHUNK);
+    log_map_offset = log_pos & ~(off_t)(page-1);
+    if (ftruncate(log_fd, log_map_offset+LOG_MAP_CHUNK)!=0)
+      error("Cannot grow log file: %s", strerror(errno));
+    log_map = mmap(NULL, LOG_MAP_CHUNK, PROT_READ|PROT_WRITE, MAP_SHARED, log_fd, log_map_offset);
+    if (log_map==MAP_FAILED)
+      error("Cannot map log file: %s", strerror(errno));
+  }
+  p = log_map + (log_pos-log_map_offset);
+  log_pos += RLOG_ALIGN(size);
+  return p;
+}
+
+static uint32_t log_new_name(const char *name) {
+  struct rlog_name *rec;
+  size_t size = sizeof(*rec)+strlen(name)+1;
+  if ((log_names[log_num_names] = strdup(name))==NULL)
+    error("log_new_name: strdup failed");
+  rec = log_reserve(size);
+  rec->type = RLOG_NAME;
+  rec->size = RLOG_ALIGN(size);
+  rec->id = log_num_names;
+  strcpy(rec->name, name);
+  return log_num_names++;
+}
+
+// Names are matched by contents: every --control load compiles its PWM and
+// mix names afresh. Once the table is full, new names share the last id.
+static uint32_t log_name_id(const char *name) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  unsigned int slot;
+  const char *p;
+  for (p=name; *p; ++p)
+    hash = (hash ^ (unsigned char)*p) * 16777619u;
+  for (slot=hash & (LOG_NAME_HASH-1); log_name_slot[slot]; slot=(slot+1) & (LOG_NAME_HASH-1))
+    if (strcmp(log_names[log_name_slot[slot]-1], name)==0)
+      return log_name_slot[slot]-1;
+  if (log_num_names>=LOG_MAX_NAMES-1) {
+    if (log_num_names==LOG_MAX_NAMES-1) {
+      printf("# WARNING: more than %d distinct names, logging the rest as OTHER\n", LOG_MAX_NAMES-1);
+      log_new_name("OTHER");
+    }
+    return LOG_MAX_NAMES-1;
+  }
+  log_name_slot[slot] = log_num_names+1;
+  return log_new_name(name);
+}
+
+// The writer moves transitions out of the edge ring as blocks come, in
+// nanoseconds, and keeps them until the entry of their step arrives.
+static int32_t *log_edge_stage;
+static size_t log_edge_staged, log_edge_stage_size;
+
+static void stage_log_edges() {
+  unsigned long tail = atomic_load_explicit(&log_edge_tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&log_edge_head, memory_order_acquire);
+  if (tail==head)
+    return;
+  if (log_edge_staged+(head-tail) > log_edge_stage_size) {
+    log_edge_stage_size = MAX(2*log_edge_stage_size, log_edge_staged+(head-tail));
+    if ((log_edge_stage = realloc(log_edge_stage, log_edge_stage_size*sizeof(int32_t)))==NULL)
+      error("Out of memory for %zu chirp transitions", log_edge_stage_size);
+  }
+  for (; tail!=head; ++tail)
+    log_edge_stage[log_edge_staged++] =
+      (int32_t)(log_edge_ring[tail & (LOG_EDGE_RING_SIZE-1)]*1e9/ticks_per_sec);
+  atomic_store_explicit(&log_edge_tail, tail, memory_order_release);
+}
+
+static void write_log_entry(const struct log_entry *entry) {
+  uint32_t name = log_name_id(entry->activity);
+  struct rlog_step *rec = log_reserve(sizeof(*rec));
+  rec->type = RLOG_STEP;
+  rec->size = sizeof(*rec);
+  rec->name = name;
+  rec->start_musec = entry->start_musec;
+  rec->end_musec = entry->end_musec;
+  rec->late_nsec = entry->late_nsec;
+  rec->deadline_musec = entry->start_musec - (entry->late_nsec+500)/1000;
+  rec->wanted_nsec = entry->wanted_nsec;
+  rec->over_nsec = entry->over_nsec;
+  add_timing(log_timings, name, entry->late_nsec, entry->over_nsec);
+  ++log_written;
+  if (entry->cores>0) {
+    unsigned long tail = atomic_load_explicit(&log_cores_tail, memory_order_relaxed);
+    const struct log_cores *cores = &log_cores_ring[tail & (LOG_CORES_RING_SIZE-1)];
+    struct rlog_cores *crec;
+    size_t size = sizeof(*crec) + 2*entry->cores*sizeof(int32_t);
+    crec = log_reserve(size);
+    crec->type = RLOG_CORES;
+    crec->size = RLOG_ALIGN(size);
+    crec->cores = entry->cores;
+    memcpy(crec->offset_nsec, cores->start_nsec, entry->cores*sizeof(int32_t));
+    memcpy(crec->offset_nsec+entry->cores, cores->end_nsec, entry->cores*sizeof(int32_t));
+    atomic_store_explicit(&log_cores_tail, tail+1, memory_order_release);
+  }
+  if (entry->perf) {
+    unsigned long tail = atomic_load_explicit(&log_perf_tail, memory_order_relaxed);
+    struct rlog_perf *prec = log_reserve(sizeof(*prec) + sizeof(struct log_perf));
+    prec->type = RLOG_PERF;
+    prec->size = RLOG_ALIGN(sizeof(*prec) + sizeof(struct log_perf));
+    prec->counters = RLOG_PERF_COUNTERS;
+    memcpy(prec->delta, log_perf_ring[tail & (LOG_CORES_RING_SIZE-1)].delta, sizeof(struct log_perf));
+    atomic_store_explicit(&log_perf_tail, tail+1, memory_order_release);
+  }
+  if (entry->edges>0) {
+    int first, count;
+    for (first=0; first<entry->edges; first+=count) {
+      struct rlog_edges *erec;
+      size_t size;
+      count = MIN(entry->edges-first, RLOG_EDGES_MAX);
+      size = sizeof(*erec) + count*sizeof(int32_t);
+      erec = log_reserve(size);
+      erec->type = RLOG_EDGES;
+      erec->size = RLOG_ALIGN(size);
+      erec->first = first;
+      erec->count = count;
+      memcpy(erec->late_nsec, log_edge_stage+first, count*sizeof(int32_t));
+    }
+    log_edge_staged -= entry->edges;
+    memmove(log_edge_stage, log_edge_stage+entry->edges, log_edge_staged*sizeof(int32_t));
+  }
+}
+
+static void write_log_sample(const struct log_sample *sample) {
+  struct rlog_sample *rec;
+  size_t size = sizeof(*rec) + 2*(sample->cpus+sample->zones)*sizeof(int32_t);
+  rec = log_reserve(size);
+  rec->type = RLOG_SAMPLE;
+  rec->size = RLOG_ALIGN(size);
+  rec->cpus = sample->cpus;
+  rec->zones = sample->zones;
+  rec->time_musec = sample->time_musec;
+  memcpy(rec->value, sample->value, 2*(sample->cpus+sample->zones)*sizeof(int32_t));
+}
+
+static void write_log_correction(const struct log_correction *correction) {
+  uint32_t name = correction->name ? log_name_id(correction->name) : 0;
+  struct rlog_correction *rec = log_reserve(sizeof(*rec));
+  rec->type = RLOG_CORRECTION;
+  rec->size = sizeof(*rec);
+  rec->fix = correction->fix;
+  rec->time_musec = correction->time_musec;
+  rec->name = name;
+  rec->reserved = 0;
+  rec->before = correction->before;
+  rec->after = correction->after;
+}
+
+static void write_log_sequence(const struct log_sequence *sequence) {
+  size_t size = sizeof(struct rlog_sequence) + (sequence->chips+7)/8;
+  uint32_t one = log_name_id(activity_name[sequence->one]);
+  uint32_t zero = log_name_id(activity_name[sequence->zero]);
+  struct rlog_sequence *rec = log_reserve(size);
+  rec->type = RLOG_SEQUENCE;
+  rec->size = RLOG_ALIGN(size);
+  rec->kind = sequence->kind;
+  rec->degree = sequence->degree;
+  rec->chips = sequence->chips;
+  rec->seed = sequence->seed;
+  rec->seed2 = sequence->seed2;
+  rec->taps = sequence->taps;
+  rec->taps2 = sequence->taps2;
+  rec->one = one;
+  rec->zero = zero;
+  rec->chip_sec = sequence->chip_sec;
+  rec->offset_sec = sequence->offset_sec;
+  memcpy(rec->bits, sequence->bits, (sequence->chips+7)/8);
+}
+
+static void drain_log() {
+  unsigned long tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&log_head, memory_order_acquire);
+  stage_log_edges(); // after reading head: it has the edges of every entry up to it
+  for (; tail!=head; ++tail) {
+    write_log_entry(&log_ring[tail & (LOG_RING_SIZE-1)]);
+    atomic_store_explicit(&log_tail, tail+1, memory_order_release);
+  }
+  tail = atomic_load_explicit(&log_sample_tail, memory_order_relaxed);
+  head = atomic_load_explicit(&log_sample_head, memory_order_acquire);
+  for (; tail!=head; ++tail) {
+    write_log_sample(&log_sample_ring[tail & (LOG_SIDE_RING_SIZE-1)]);
+    atomic_store_explicit(&log_sample_tail, tail+1, memory_order_release);
+  }
+  tail = atomic_load_explicit(&log_correction_tail, memory_order_relaxed);
+  head = atomic_load_explicit(&log_correction_head, memory_order_acquire);
+  for (; tail!=head; ++tail) {
+    write_log_correction(&log_correction_ring[tail & (LOG_SIDE_RING_SIZE-1)]);
+    atomic_store_explicit(&log_correction_tail, tail+1, memory_order_release);
+  }
+  tail = atomic_load_explicit(&log_sequence_tail, memory_order_relaxed);
+  head = atomic_load_explicit(&log_sequence_head, memory_order_acquire);
+  for (; tail!=head; ++tail) {
+    write_log_sequence(log_sequence_ring[tail & (LOG_SIDE_RING_SIZE-1)]);
+    atomic_store_explicit(&log_sequence_tail, tail+1, memory_order_release);
+  }
+}
+
+static void *log_writer(void *arg) {
+  struct timespec poll = {0, 1000000};
+  FILE *out;
+  lower_thread_priority();
+  while (!atomic_load(&log_stop)) {
+    drain_log();
+    if (log_report_requested) {
+      log_report_requested = 0;
+      report_timing(stdout, log_timings, log_names, log_num_names);
+      fflush(stdout);
+    }
+    if ((out = atomic_load(&log_report_out))!=NULL) {
+      report_timing(out, log_timings, log_names, log_num_names);
+      fflush(out);
+      atomic_store(&log_report_out, NULL);
+    }
+    if (atomic_load(&log_flush_requested)) {
+      if (log_map!=NULL)
+        msync(log_map, LOG_MAP_CHUNK, MS_SYNC);
+      fsync(log_fd);
+      atomic_store(&log_flush_requested, 0);
+    }
+    nanosleep(&poll, NULL);
+  }
+  drain_log();
+  return NULL;
+}
+
+// Faults in the rings the run writes to, while nothing else touches them.
+static void prefault_rings() {
+  prefault(log_ring, sizeof(log_ring));
+  prefault(log_cores_ring, sizeof(log_cores_ring));
+  prefault(log_perf_ring, sizeof(log_perf_ring));
+  prefault(log_sequence_ring, sizeof(log_sequence_ring));
+  prefault(log_sample_ring, sizeof(log_sample_ring));
+  prefault(log_correction_ring, sizeof(log_correction_ring));
+  prefault(log_edge_ring, sizeof(log_edge_ring));
+  prefault(say_ring, sizeof(say_ring));
+  prefault(shout_ring, sizeof(shout_ring));
+}
+
+static void start_log(const char *path) {
+  struct rlog_header *header;
+  if (path) {
+    log_fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (log_fd<0)
+      error("Cannot open log file %s: %s", path, strerror(errno));
+  } else {
+    FILE *tmp = tmpfile();
+    if (tmp==NULL)
+      error("Cannot create temporary log file: %s", strerror(errno));
+    log_fd = dup(fileno(tmp));
+    fclose(tmp);
+  }
+  header = log_reserve(sizeof(*header));
+  memset(header, 0, sizeof(*header));
+  strncpy(header->magic, RLOG_MAGIC, sizeof(header->magic));
+  header->version = RLOG_VERSION;
+  header->header_size = RLOG_ALIGN(sizeof(*header));
+  strncpy(header->timebase, timebase_name[timebase], sizeof(header->timebase)-1);
+  header->ticks_per_sec = ticks_per_sec;
+  header->sleep_granularity_musec = sleep_granularity;
+  header->start_musec = start_musec;
+  memcpy(header->vector, vector_name, sizeof(header->vector));
+  header->vector_bits = vector_bits;
+  if (pthread_create(&log_thread, NULL, log_writer, NULL)!=0)
+    error("Cannot start log writer thread");
+  signal(SIGUSR1, request_log_report);
+}
+
+// Stops the writer and leaves the file trimmed to its contents.
+static void finish_log() {
+  if (log_fd<0 || atomic_exchange(&log_stop, 1))
+    return;
+  pthread_join(log_thread, NULL);
+  munmap(log_map, LOG_MAP_CHUNK);
+  log_map = NULL;
+  if (ftruncate(log_fd, log_pos)!=0)
+    error("Cannot trim log file: %s", strerror(errno));
+}
+
+// Prints a binary log in the "> start end duration name" text format.
+static void convert_log(int fd) {
+  struct stat st;
+  const char *map, *p, *end;
+  const struct rlog_header *header;
+  const char **names = NULL;
+  struct timing **timings = NULL;
+  struct perf_sum **perf_sums = NULL;
+  unsigned int num_names = 0, last_name = UINT32_MAX, i;
+  long long late_sum = 0, late_max = 0, steps = 0;
+  long long skew_steps = 0, start_skew_sum = 0, start_skew_max = 0, end_skew_sum = 0, end_skew_max = 0;
+  long long samples = 0, edges = 0, edge_late_sum = 0, edge_late_max = 0;
+  int32_t khz_min = INT32_MAX, khz_max = 0, temp_max = INT32_MIN;
+
+  if (fstat(fd, &st)!=0)
+    error("Cannot stat log file: %s", strerror(errno));
+  if (st.st_size < (off_t)sizeof(*header))
+    error("Log file too short");
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map==MAP_FAILED)
+    error("Cannot map log file: %s", strerror(errno));
+  header = (const struct rlog_header *)map;
+  if (strncmp(header->magic, RLOG_MAGIC, sizeof(header->magic))!=0 || header->version<1 || header->version>RLOG_VERSION)
+    error("Not a rattle log (or wrong version)");
+  if (header->version>=2 && header->vector_bits>0)
+    printf("# Vector: %.16s (%u-bit)\n", header->vector, header->vector_bits);
+  end = map+st.st_size;
+  for (p=map+header->header_size; p+sizeof(struct rlog_record)<=end; ) {
+    const struct rlog_record *rec = (const struct rlog_record *)p;
+    if (rec->type==RLOG_END || rec->size==0 || p+rec->size>end)
+      break;
+    if (rec->type==RLOG_NAME) {
+      const struct rlog_name *name = (const struct rlog_name *)rec;
+      if (name->id>=num_names) {
+        names = realloc(names, (name->id+1)*sizeof(*names));
+        timings = realloc(timings, (name->id+1)*sizeof(*timings));
+        perf_sums = realloc(perf_sums, (name->id+1)*sizeof(*perf_sums));
+        if (names==NULL || timings==NULL || perf_sums==NULL)
+          error("convert_log: realloc failed");
+        while (num_names<=name->id) {
+          timings[num_names] = NULL;
+          perf_sums[num_names] = NULL;
+          names[num_names++] = "?";
+        }
+      }
+      names[name->id] = name->name;
+    } else if (rec->type==RLOG_STEP) {
+      const struct rlog_step *step = (const struct rlog_step *)rec;
+      printf("> %12.9f %12.9f %12.9f  %s\n",
+         ((double)(step->start_musec-header->start_musec))/MUSEC_SEC,
+         ((double)(step->end_musec-header->start_musec))/MUSEC_SEC,
+         ((double)(step->end_musec-step->start_musec))/MUSEC_SEC,
+         step->name<num_names ? names[step->name] : "?");
+      late_sum += step->late_nsec;
+      late_max = MAX(late_max, step->late_nsec);
+      last_name = step->name;
+      ++steps;
+      if (step->size>=sizeof(*step) && step->name<num_names)
+        add_timing(timings, step->name, step->late_nsec, step->over_nsec);
+    } else if (rec->type==RLOG_SAMPLE) {
+      const struct rlog_sample *sample = (const struct rlog_sample *)rec;
+      for (i=0; i<sample->cpus; ++i) {
+        if (sample->value[2*i+1]<=0)
+          continue; // offline or unreadable
+        khz_min = MIN(khz_min, sample->value[2*i+1]);
+        khz_max = MAX(khz_max, sample->value[2*i+1]);
+      }
+      for (i=sample->cpus; i<(unsigned int)sample->cpus+sample->zones; ++i)
+        temp_max = MAX(temp_max, sample->value[2*i+1]);
+      ++samples;
+    } else if (rec->type==RLOG_CORRECTION) {
+      const struct rlog_correction *fix = (const struct rlog_correction *)rec;
+      if (fix->fix==RLOG_FIX_TICK_RATE)
+        printf("# %.6f: tick rate corrected from %.1f to %.1f per sec\n",
+               ((double)(fix->time_musec-header->start_musec))/MUSEC_SEC, fix->before, fix->after);
+      else if (fix->fix==RLOG_FIX_UNROLL)
+        printf("# %.6f: %s loop changed from %.0f to %.0f per clock read\n",
+               ((double)(fix->time_musec-header->start_musec))/MUSEC_SEC,
+               fix->name<num_names ? names[fix->name] : "?", fix->before, fix->after);
+    } else if (rec->type==RLOG_SEQUENCE) {
+      const struct rlog_sequence *seq = (const struct rlog_sequence *)rec;
+      uint32_t k;
+      if (rec->size < sizeof(*seq)+(seq->chips+7)/8) {
+        p += rec->size;
+        continue;
+      }
+      printf("# Sequence: %s degree %u, seed %u", seq->kind==RLOG_SEQ_GOLD ? "gold" : "m-sequence",
+             seq->degree, seq->seed);
+      if (seq->kind==RLOG_SEQ_GOLD)
+        printf("/%u", seq->seed2);
+      printf(", %u chips of %gs from %.6fs, 1=%s 0=%s\n# Chips: ", seq->chips, seq->chip_sec, seq->offset_sec,
+             seq->one<num_names ? names[seq->one] : "?", seq->zero<num_names ? names[seq->zero] : "?");
+      for (k=0; k<seq->chips; ++k)
+        putchar('0' + (seq->bits[k/8] >> (k%8) & 1));
+      putchar('\n');
+    } else if (rec->type==RLOG_PERF) {
+      const struct rlog_perf *perf = (const struct rlog_perf *)rec;
+      if (last_name<num_names && rec->size>=sizeof(*perf)+perf->counters*sizeof(int64_t))
+        add_perf(perf_sums, last_name, perf->delta, perf->counters);
+    } else if (rec->type==RLOG_EDGES) {
+      const struct rlog_edges *edge = (const struct rlog_edges *)rec;
+      uint32_t k;
+      for (k=0; k<edge->count && sizeof(*edge)+(k+1)*sizeof(int32_t)<=rec->size; ++k) {
+        edge_late_sum += edge->late_nsec[k];
+        edge_late_max = MAX(edge_late_max, edge->late_nsec[k]);
+        ++edges;
+      }
+    } else if (rec->type==RLOG_CORES) {
+      const struct rlog_cores *cores = (const struct rlog_cores *)rec;
+      int32_t lo[2] = {INT32_MAX, INT32_MAX}, hi[2] = {INT32_MIN, INT32_MIN};
+      uint32_t i;
+      for (i=0; i<2*cores->cores; ++i) {
+        if (cores->offset_nsec[i]==RLOG_CORE_IDLE)
+          continue;
+        lo[i/cores->cores] = MIN(lo[i/cores->cores], cores->offset_nsec[i]);
+        hi[i/cores->cores] = MAX(hi[i/cores->cores], cores->offset_nsec[i]);
+      }
+      if (lo[0]>hi[0]) {
+        p += rec->size;
+        continue;
+      }
+      start_skew_sum += hi[0]-lo[0];
+      start_skew_max = MAX(start_skew_max, hi[0]-lo[0]);
+      end_skew_sum += hi[1]-lo[1];
+      end_skew_max = MAX(end_skew_max, hi[1]-lo[1]);
+      ++skew_steps;
+    }
+    p += rec->size;
+  }
+  if (steps>0)
+    printf("# Start lateness: mean %.3fus, max %.3fus over %lld steps\n",
+           late_sum/1000.0/steps, late_max/1000.0, steps);
+  if (skew_steps>0)
+    printf("# Core skew: start mean %.0fns, max %lldns; end mean %.0fns, max %lldns over %lld steps\n",
+           1.0*start_skew_sum/skew_steps, start_skew_max, 1.0*end_skew_sum/skew_steps, end_skew_max, skew_steps);
+  if (edges>0)
+    printf("# Chirp transitions: lateness mean %.0fns, max %lldns over %lld\n",
+           1.0*edge_late_sum/edges, edge_late_max, edges);
+  if (samples>0) {
+    printf("# Monitor: %lld samples", samples);
+    if (khz_max>0)
+      printf(", CPU clock %.0f-%.0fMHz", khz_min/1000.0, khz_max/1000.0);
+    if (temp_max>INT32_MIN)
+      printf(", hottest zone %.1fC", temp_max/1000.0);
+    printf("\n");
+  }
+  report_timing(stdout, timings, names, num_names);
+  report_perf(perf_sums, names, num_names);
+  for (i=0; i<num_names; ++i) {
+    free(timings[i]);
+    free(perf_sums[i]);
+  }
+  free(timings);
+  free(perf_sums);
+  free(names);
+  munmap((void *)map, st.st_size);
+}
+
+static void dump_log() {
+  finish_log();
+  convert_log(log_fd);
+  if (log_dropped>0)
+    printf("# WARNING: %lu log entries dropped (writer too slow)\n", log_dropped);
+  if (log_edges_dropped>0)
+    printf("# WARNING: %lu chirp transitions not recorded (edge ring full)\n", log_edges_dropped);
+}
+
+static void log2text(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd<0)
+    error("Cannot open %s: %s", path, strerror(errno));
+  convert_log(fd);
+  close(fd);
+}
+
+
+/****************************************************************************/
+// Memory
+//
+// MEMORY, MEMW0 and MEMW1 work on an mmap'd buffer whose size, access
+// pattern and page size come from the command line, so a run can aim at one
+// level of the cache hierarchy. MEMORY walks it in one of these modes:
+//   stride  one int every --mem-stride bytes, wrapping at the working set
+//   chase   dependent loads around a random cycle of --mem-stride byte nodes
+//   stream  every int in order
+//   nt      16-byte non-temporal stores in order
+// --mem-write PCT makes that share of stride, chase and stream accesses
+// stores. The chase cycle lives in a buffer of its own so that MEMW0 and
+// MEMW1 cannot break it.
+
+typedef enum {MEM_STRIDE, MEM_CHASE, MEM_STREAM, MEM_NT, NUM_MEM_MODES} mem_mode_t;
+static const char *const mem_mode_name[NUM_MEM_MODES] = {"stride", "chase", "stream", "nt"};
+typedef enum {PAGES_SMALL, PAGES_THP, PAGES_HUGE, NUM_PAGE_KINDS} mem_pages_t;
+static const char *const mem_pages_name[NUM_PAGE_KINDS] = {"small", "thp", "huge"};
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static size_t mem_ws = SAND_SIZE*sizeof(int);
+static size_t mem_stride = 257*sizeof(int);
+static mem_mode_t mem_mode = MEM_STRIDE;
+static mem_pages_t mem_pages = PAGES_SMALL;
+static int mem_write_pct = 0;
+
+static int *sand;                   // mem_ws bytes
+static size_t sand_ints;
+static void **chain;                // chase mode: a node of the cycle
+static uint64_t mem_write_mask;     // bit n set: access n of every 64 stores
+
+// Where each thread's walk continues, so workers do not share a cursor
+static _Thread_local size_t memory_pos, memw_pos;
+static _Thread_local void **memory_node;
+static _Thread_local unsigned int memory_access;
+
+// Parses a byte count with an optional k, m or g suffix
+static size_t parse_size(const char *option, const char *text) {
+  char *end;
+  double size = strtod(text, &end);
+  switch (tolower((unsigned char)*end)) {
+  case 'g': size *= 1024; // fall through
+  case 'm': size *= 1024; // fall through
+  case 'k': size *= 1024; ++end;
+  }
+  if (end==text || *end!='\0' || size<1)
+    error("%s wants a size like 256k or 64m: %s", option, text);
+  return (size_t)size;
+}
+
+static int parse_choice(const char *option, const char *text, const char *const *names, int n) {
+  int i;
+  for (i=0; i<n; ++i)
+    if (strcmp(text, names[i])==0)
+      return i;
+  error("Unknown %s: %s", option, text);
+  return -1;
+}
+
+static void *map_buffer(size_t bytes) {
+  int flags = MAP_PRIVATE|MAP_ANON;
+  size_t mapped = bytes;
+  char *p;
+  if (mem_pages==PAGES_HUGE) {
+#if defined(MAP_HUGETLB)
+    flags |= MAP_HUGETLB;
+#else
+    error("--mem-pages huge needs MAP_HUGETLB, which this system lacks");
+#endif
+  } else if (mem_pages==PAGES_THP)
+    mapped += HUGE_PAGE_SIZE; // room to align to a huge page
+  p = mmap(NULL, mapped, PROT_READ|PROT_WRITE, flags, -1, 0);
+  if (p==MAP_FAILED)
+    error("Cannot map %zu bytes of %s pages: %s", mapped, mem_pages_name[mem_pages], strerror(errno));
+  if (mem_pages==PAGES_THP) {
+    p = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE-1) & ~(uintptr_t)(HUGE_PAGE_SIZE-1));
+#if defined(MADV_HUGEPAGE)
+    if (madvise(p, bytes, MADV_HUGEPAGE)!=0)
+      printf("# madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+#else
+    puts("# Transparent huge pages are not available here, using small pages");
+#endif
+  }
+  return p;
+}
+
+// Links the mem_stride sized nodes of buf into one random cycle (Sattolo's
+// algorithm), so every load depends on the one before and the prefetchers
+// cannot guess the next address.
+static void **build_chain(char *buf, size_t nodes) {
+  size_t *order = malloc(nodes*sizeof(size_t));
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  size_t i, j, t;
+  if (order==NULL)
+    error("Out of memory for %zu chase nodes", nodes);
+  for (i=0; i<nodes; ++i)
+    order[i] = i;
+  for (i=nodes-1; i>0; --i) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    j = seed % i;
+    t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+  for (i=0; i<nodes; ++i)
+    *(void **)(buf + order[i]*mem_stride) = buf + order[(i+1)%nodes]*mem_stride;
+  free(order);
+  return (void **)buf;
+}
+
+static void init_memory() {
+  size_t page = mem_pages==PAGES_SMALL ? (size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+  int i, writes = (mem_write_pct*64+50)/100;
+
+  mem_ws = (mem_ws+page-1) & ~(page-1);
+  if (mem_stride%sizeof(int)!=0 || mem_stride>=mem_ws)
+    error("--mem-stride must be a multiple of %zu below the working set", sizeof(int));
+  if (mem_mode==MEM_CHASE && (mem_stride%sizeof(void *)!=0 || mem_stride<2*sizeof(void *)))
+    error("--mem-mode chase needs a --mem-stride that is a multiple of %zu, at least %zu",
+          sizeof(void *), 2*sizeof(void *));
+  mem_write_mask = 0;
+  for (i=0; i<64; ++i)
+    if ((i+1)*writes/64 != i*writes/64)
+      mem_write_mask |= 1ULL << i;
+
+  sand = map_buffer(mem_ws);
+  sand_ints = mem_ws/sizeof(int);
+  memset(sand, 0xFF, mem_ws); // fault every page in before timing starts
+  if (mem_mode==MEM_CHASE) {
+    chain = build_chain(map_buffer(mem_ws), mem_ws/mem_stride);
+    prefault(chain, mem_ws); // a stride above the page size skips pages
+  }
+
+  printf("# Memory: %zu KiB working set, %s", mem_ws/1024, mem_mode_name[mem_mode]);
+  if (mem_mode==MEM_STRIDE || mem_mode==MEM_CHASE)
+    printf(" every %zu bytes", mem_stride);
+  if (mem_mode!=MEM_NT && mem_write_pct>0)
+    printf(", %d%% stores", mem_write_pct);
+  printf(", %s pages\n", mem_pages_name[mem_pages]);
+}
+
+
+/****************************************************************************/
+// Activities
+
+// Each loop comes in several unrolls, and calibrate_loops() picks for each
+// activity the longest one whose time between clock reads stays within
+// --loop-bound. Cheap operations then amortise the clock read, and slow ones
+// (memory misses) do not overshoot their end tick by much. Loops return
+// how many times they ran CODE.
+
+#define NUM_UNROLLS 4
+static const int unroll_ops[NUM_UNROLLS] = {8, 32, 128, 512};
+
+#define REPEAT8(X) X; X; X; X; X; X; X; X;
+#define REPEAT32(X) REPEAT8(X) REPEAT8(X) REPEAT8(X) REPEAT8(X)
+#define REPEAT128(X) REPEAT32(X) REPEAT32(X) REPEAT32(X) REPEAT32(X)
+#define REPEAT512(X) REPEAT128(X) REPEAT128(X) REPEAT128(X) REPEAT128(X)
+
+typedef long long (*loop_fn)(tick_t end_tick);
+
+#define DEFINE_LOOP(NAME,PRECODE,CODE) DEFINE_LOOP_POST(NAME,PRECODE,CODE,{})
+
+// POSTCODE runs once the end tick has passed, to save state for next time
+#define DEFINE_LOOP_POST(NAME,PRECODE,CODE,POSTCODE) DEFINE_LOOP_FOR(,NAME,PRECODE,CODE,POSTCODE)
+
+// ATTRS lets a loop use instructions the compiler is not targeting by default
+#define DEFINE_LOOP_FOR(ATTRS,NAME,PRECODE,CODE,POSTCODE) \
+DEFINE_UNROLLED(ATTRS,NAME,8,PRECODE,CODE,POSTCODE) \
+DEFINE_UNROLLED(ATTRS,NAME,32,PRECODE,CODE,POSTCODE) \
+DEFINE_UNROLLED(ATTRS,NAME,128,PRECODE,CODE,POSTCODE) \
+DEFINE_UNROLLED(ATTRS,NAME,512,PRECODE,CODE,POSTCODE) \
+static const loop_fn loops_##NAME[NUM_UNROLLS] = \
+  {loop_##NAME##_8, loop_##NAME##_32, loop_##NAME##_128, loop_##NAME##_512};
+
+#define DEFINE_UNROLLED(ATTRS,NAME,N,PRECODE,CODE,POSTCODE) \
+static ATTRS long long loop_##NAME##_##N(tick_t end_tick) \
+{ \
+  long long blocks = 0; \
+  tick_t now_tick; rdtscll(now_tick); \
+  PRECODE; \
+  while (now_tick < end_tick) { \
+    REPEAT##N(CODE) \
+    ++blocks; \
+    rdtscll(now_tick); \
+  } \
+  POSTCODE; \
+  return blocks*N; \
+}
+
+#if defined(__arm64__) || defined(__aarch64__)
+DEFINE_LOOP(PAUSE, {},  asm volatile ("nop"));
+DEFINE_LOOP(ADD, {}, asm volatile ("add w0, w0, #0" : : : "w0") );
+DEFINE_LOOP(MUL, {}, asm volatile ("mul w0, w1, w2" : : : "w0", "w1", "w2") );
+DEFINE_LOOP(FMUL, {}, asm volatile ("fmul s14, s14, s15" : : : "v14", "v15") );
+DEFINE_LOOP(MUL_FMUL, {}, asm volatile ("mul w0, w1, w2\n\tfmul s14, s14, s15" : : : "w0", "w1", "w2", "v14", "v15") );
+#elif defined(__i386__) || defined(__x86_64__)
+DEFINE_LOOP(PAUSE, {},  asm volatile ("rep;nop"));
+DEFINE_LOOP(ADD, {}, asm volatile ("addl $0, %%eax" : : : "eax") );
+DEFINE_LOOP(MUL, {}, asm volatile ("mull %%edx" : : : "eax", "edx") );
+DEFINE_LOOP(FMUL, {}, asm volatile ("fmulp") );
+DEFINE_LOOP(MUL_FMUL, {}, asm volatile ("mull %%edx; fmulp" : : : "eax", "edx") );
+#else
+#error "loops not defined for this arch"
+#endif
+// Quotients go to a file-scope sink, so the divides are not dead code
+static volatile int div_sink;
+DEFINE_LOOP(DIV2, volatile int y=2, div_sink = 0x77777777/y );
+DEFINE_LOOP(DIV8209, volatile int y=2, div_sink = 0x77777777/y );
+
+// Stores 16 bytes around the caches
+#if defined(__arm64__) || defined(__aarch64__)
+#define STORE_NT16(p,v) asm volatile ("stnp %1, %1, [%0]" : : "r"(p), "r"((uint64_t)(v)) : "memory")
+#define FENCE_NT()
+#elif defined(__x86_64__)
+#define STORE_NT16(p,v) asm volatile ("movnti %1, (%0); movnti %1, 8(%0)" : : "r"(p), "r"((uint64_t)(v)) : "memory")
+#define FENCE_NT() asm volatile ("sfence" : : : "memory")
+#else
+#define STORE_NT16(p,v) asm volatile ("movnti %1, (%0); movnti %1, 4(%0); movnti %1, 8(%0); movnti %1, 12(%0)" \
+                                      : : "r"(p), "r"((uint32_t)(v)) : "memory")
+#define FENCE_NT() asm volatile ("sfence" : : : "memory")
+#endif
+
+#define MEM_STORE_NEXT(w,k) (((w) >> ((k)++ & 63)) & 1)
+
+DEFINE_LOOP_POST(MEM_STRIDE,
+  size_t i = memory_pos; unsigned int k = memory_access; const size_t step = mem_stride/sizeof(int);
+  const size_t n = sand_ints; const uint64_t w = mem_write_mask; volatile int x,
+  if (MEM_STORE_NEXT(w,k)) sand[i] = k; else x = sand[i]; i += step; if (i >= n) i -= n; ,
+  memory_pos = i; memory_access = k; (void)x );
+DEFINE_LOOP_POST(MEM_CHASE,
+  void **p = memory_node ? memory_node : chain; unsigned int k = memory_access;
+  const uint64_t w = mem_write_mask,
+  if (MEM_STORE_NEXT(w,k)) p[1] = p; p = (void **)*p; ,
+  memory_node = p; memory_access = k );
+DEFINE_LOOP_POST(MEM_STREAM,
+  size_t i = memory_pos; unsigned int k = memory_access; const size_t n = sand_ints;
+  const uint64_t w = mem_write_mask; volatile int x,
+  if (MEM_STORE_NEXT(w,k)) sand[i+3]=sand[i+2]=sand[i+1]=sand[i]=k; else x = sand[i]+sand[i+1]+sand[i+2]+sand[i+3];
+  i += 4; if (i >= n) i = 0; ,
+  memory_pos = i; memory_access = k; (void)x );
+DEFINE_LOOP_POST(MEM_NT,
+  size_t i = memory_pos; const size_t n = sand_ints,
+  STORE_NT16(sand+i, i); i += 4; if (i >= n) i = 0; ,
+  memory_pos = i; FENCE_NT() );
+DEFINE_LOOP_POST(MEMW0, size_t i = memw_pos; const size_t n = sand_ints,
+  sand[i+3]=sand[i+2]=sand[i+1]=sand[i]= 0; i += 4; if (i >= n) i = 0; , memw_pos = i );
+DEFINE_LOOP_POST(MEMW1, size_t i = memw_pos; const size_t n = sand_ints,
+  sand[i+3]=sand[i+2]=sand[i+1]=sand[i]=-1; i += 4; if (i >= n) i = 0; , memw_pos = i );
+
+// Coherence activities make traffic between cores rather than work inside
+// one. Every thread running them has a rank: the activity thread is 0,
+// engine workers follow, then the --partners threads. PINGPONG bounces a
+// line and HANDOFF passes values through a queue between ranks 2p and 2p+1;
+// CONTEND has all ranks fetch-and-add one line, and FALSESHARE has them
+// write their own word of one line. The activity thread releases the
+// partners when its loop starts, and they run the same loop until its end
+// tick. Each CODE is one attempt that never waits, so the loops still read
+// the clock on time when the other side is missing or late.
+
+#define MAX_PARTNERS 16
+#define MAX_RANKS (MAX_WORKERS+MAX_PARTNERS)
+#define HANDOFF_SLOTS 64
+
+struct coherence_pair {
+  _Alignas(64) atomic_ulong ball;          // PINGPONG: rank 2p moves it on even values
+  _Alignas(64) atomic_ulong head;          // HANDOFF: written by rank 2p
+  _Alignas(64) atomic_ulong tail;          // and by rank 2p+1
+  _Alignas(64) unsigned long slot[HANDOFF_SLOTS];
+};
+
+static struct coherence_pair coherence_pairs[MAX_RANKS/2];
+static _Alignas(64) atomic_ulong contend_line;
+static _Alignas(64) volatile unsigned long falseshare_line[8];
+static _Thread_local int coherence_rank;
+
+static int num_partners = 0;
+static _Alignas(64) atomic_ulong partner_released;  // generation, bumped per loop
+static atomic_int partner_act;
+static atomic_llong partner_end;
+
+static inline void release_partners(activity_t act, tick_t end_tick) {
+  if (num_partners==0 || coherence_rank!=0)
+    return;
+  atomic_store_explicit(&partner_act, act, memory_order_relaxed);
+  atomic_store_explicit(&partner_end, end_tick, memory_order_relaxed);
+  atomic_fetch_add_explicit(&partner_released, 1, memory_order_release);
+}
+
+DEFINE_LOOP(PINGPONG,
+  release_partners(A_PINGPONG, end_tick); atomic_ulong *ball = &coherence_pairs[coherence_rank/2].ball;
+  const unsigned long side = coherence_rank&1,
+  { unsigned long v = atomic_load_explicit(ball, memory_order_acquire);
+    if ((v&1)==side) atomic_store_explicit(ball, v+1, memory_order_release); } );
+DEFINE_LOOP(CONTEND, release_partners(A_CONTEND, end_tick),
+  atomic_fetch_add_explicit(&contend_line, 1, memory_order_relaxed) );
+DEFINE_LOOP(FALSESHARE,
+  release_partners(A_FALSESHARE, end_tick); volatile unsigned long *word = &falseshare_line[coherence_rank&7],
+  ++*word );
+DEFINE_LOOP_POST(HANDOFF,
+  release_partners(A_HANDOFF, end_tick); struct coherence_pair *q = &coherence_pairs[coherence_rank/2];
+  const int producer = !(coherence_rank&1); volatile unsigned long got = 0,
+  if (producer) {
+    unsigned long h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&q->tail, memory_order_acquire) < HANDOFF_SLOTS) {
+      q->slot[h % HANDOFF_SLOTS] = h;
+      atomic_store_explicit(&q->head, h+1, memory_order_release);
+    }
+  } else {
+    unsigned long t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (t != atomic_load_explicit(&q->head, memory_order_acquire)) {
+      got = q->slot[t % HANDOFF_SLOTS];
+      atomic_store_explicit(&q->tail, t+1, memory_order_release);
+    }
+  } ,
+  (void)got );
+
+// Vector kernels. Each asm statement advances twelve independent
+// accumulator chains, enough to cover the FMA latency on every pipe, with
+// operands 12 and 13 as the multiplicands. The accumulators only ever grow
+// by small positive steps, so they never reach denormals or infinity.
+#define FMA_CHAINS(I) I(0) I(1) I(2) I(3) I(4) I(5) I(6) I(7) I(8) I(9) I(10) I(11)
+#define FMA_ACCUMULATORS(C) "+" C (a[0]), "+" C (a[1]), "+" C (a[2]), "+" C (a[3]), "+" C (a[4]), "+" C (a[5]), \
+                            "+" C (a[6]), "+" C (a[7]), "+" C (a[8]), "+" C (a[9]), "+" C (a[10]), "+" C (a[11])
+static volatile float fma_sink;
+#define FMA_SINK(N) { fma_sink = a[0][0]+a[11][N-1]; }
+
+#if defined(__arm64__) || defined(__aarch64__)
+#define NEON_FMLA(n) "fmla %" #n ".4s, %12.4s, %13.4s\n\t"
+DEFINE_LOOP_POST(FMA128,
+  float32x4_t a[12] = {{0}}; const float32x4_t x = vdupq_n_f32(1.0f); const float32x4_t y = vdupq_n_f32(1e-3f),
+  asm volatile (FMA_CHAINS(NEON_FMLA) : FMA_ACCUMULATORS("w") : "w"(x), "w"(y)); ,
+  FMA_SINK(4) );
+#if defined(__linux__)
+// SVE registers cannot be asm operands without compiling for SVE, so each
+// statement sets up its own multiplicands and leaves the accumulators to
+// carry over in z0-z11.
+#define SVE_FMLA(n) "fmla z" #n ".s, p0/m, z12.s, z13.s\n\t"
+DEFINE_LOOP(FMASVE, {},
+  asm volatile (".arch_extension sve\n\tptrue p0.s\n\tfmov z12.s, #1.0\n\tfmov z13.s, #0.125\n\t"
+                FMA_CHAINS(SVE_FMLA) FMA_CHAINS(SVE_FMLA)
+                : : : "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "v8", "v9", "v10", "v11", "v12", "v13", "p0") );
+#endif
+#elif defined(__x86_64__)
+// SSE has no fused multiply-add, so FMA128 alternates mulps and addps chains
+#define SSE_MULADD(n) "mulps %12, %" #n "\n\taddps %13, %" #n "\n\t"
+#define AVX_FMADD(n) "vfmadd231ps %12, %13, %" #n "\n\t"
+DEFINE_LOOP_POST(FMA128,
+  __m128 a[12] = {{0}}; const __m128 x = _mm_set1_ps(1.0f); const __m128 y = _mm_set1_ps(1e-3f),
+  asm volatile (FMA_CHAINS(SSE_MULADD) : FMA_ACCUMULATORS("x") : "x"(x), "x"(y)); ,
+  FMA_SINK(4) );
+DEFINE_LOOP_FOR(__attribute__((target("avx2,fma"))), FMA256,
+  __m256 a[12] = {{0}}; const __m256 x = _mm256_set1_ps(1.0f); const __m256 y = _mm256_set1_ps(1e-3f),
+  asm volatile (FMA_CHAINS(AVX_FMADD) : FMA_ACCUMULATORS("x") : "x"(x), "x"(y)); ,
+  FMA_SINK(8) );
+DEFINE_LOOP_FOR(__attribute__((target("avx512f"))), FMA512,
+  __m512 a[12] = {{0}}; const __m512 x = _mm512_set1_ps(1.0f); const __m512 y = _mm512_set1_ps(1e-3f),
+  asm volatile (FMA_CHAINS(AVX_FMADD) : FMA_ACCUMULATORS("v") : "v"(x), "v"(y)); ,
+  FMA_SINK(16) );
+#endif
+
+// MEMORY runs the loop for --mem-mode
+static const loop_fn *const memory_loops[NUM_MEM_MODES] = {
+  [MEM_STRIDE] = loops_MEM_STRIDE, [MEM_CHASE] = loops_MEM_CHASE,
+  [MEM_STREAM] = loops_MEM_STREAM, [MEM_NT] = loops_MEM_NT,
+};
+
+// The unrolls of each activity's loop. NULL for activities this arch has
+// no loop for; SLEEP is handled by idle_until().
+static const loop_fn *activity_loops[NUM_ACTIVITY] = {
+  [A_MUL] = loops_MUL, [A_ADD] = loops_ADD, [A_MEMORY] = loops_MEM_STRIDE, [A_PAUSE] = loops_PAUSE,
+  [A_DIV2] = loops_DIV2, [A_DIV8209] = loops_DIV8209, [A_MEMW0] = loops_MEMW0, [A_MEMW1] = loops_MEMW1,
+  [A_FMUL] = loops_FMUL, [A_MUL_FMUL] = loops_MUL_FMUL,
+  [A_PINGPONG] = loops_PINGPONG, [A_CONTEND] = loops_CONTEND, [A_FALSESHARE] = loops_FALSESHARE,
+  [A_HANDOFF] = loops_HANDOFF,
+  // the FMA family is filled in by init_vector()
+};
+
+// Loops that spin until a given tick, indexed by activity: the unroll
+// calibrate_loops() chose. adapt_unroll() changes them between steps while
+// workers may be looking theirs up, hence the atomics.
+static _Atomic(loop_fn) activity_loop[NUM_ACTIVITY];
+
+static inline loop_fn get_loop(activity_t act) {
+  return atomic_load_explicit(&activity_loop[act], memory_order_relaxed);
+}
+
+static inline void set_loop(activity_t act, loop_fn loop) {
+  atomic_store_explicit(&activity_loop[act], loop, memory_order_relaxed);
+}
+
+static long long loop_bound_nsec = 1000;
+
+static void use_vector(activity_t act, const loop_fn *loops, const char *name, unsigned int bits) {
+  activity_loops[act] = loops;
+  activity_loops[A_FMA] = loops;
+  snprintf(vector_name, sizeof(vector_name), "%s", name);
+  vector_bits = bits;
+}
+
+// Enables the FMA kernels this CPU can run, and points FMA at the widest.
+static void init_vector() {
+#if defined(__arm64__) || defined(__aarch64__)
+  use_vector(A_FMA128, loops_FMA128, "neon", 128); // NEON is part of the base ISA
+#if defined(__linux__) && defined(HWCAP_SVE)
+  if (getauxval(AT_HWCAP) & HWCAP_SVE) {
+    uint64_t bytes;
+    asm volatile (".arch_extension sve\n\trdvl %0, #1" : "=r"(bytes));
+    use_vector(A_FMASVE, loops_FMASVE, "sve", 8*bytes);
+  }
+#endif
+#elif defined(__x86_64__)
+  __builtin_cpu_init();
+  use_vector(A_FMA128, loops_FMA128, "sse", 128);
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    use_vector(A_FMA256, loops_FMA256, "avx2", 256);
+  if (__builtin_cpu_supports("avx512f"))
+    use_vector(A_FMA512, loops_FMA512, "avx512", 512);
+#endif
+  if (vector_bits>0)
+    printf("# Vector: FMA runs %s (%u-bit)\n", vector_name, vector_bits);
+}
+
+// Runs one unroll of a loop for about a millisecond and tells how long a
+// block between clock reads took, and how many CODE copies ran per second.
+static void time_loop(activity_t act, int u, double *block_nsec, double *ops_per_sec) {
+  tick_t start, end;
+  long long ops;
+  rdtscll(start);
+  ops = activity_loops[act][u](start+ticks_per_sec/1000);
+  rdtscll(end);
+  *block_nsec = 1e9*(end-start)/ticks_per_sec/MAX(ops/unroll_ops[u], 1);
+  *ops_per_sec = ops*ticks_per_sec/(double)(end-start);
+}
+
+// What calibrate_loops() chose per activity, kept for the calibration cache
+static int loop_unroll[NUM_ACTIVITY];
+static double loop_block_nsec[NUM_ACTIVITY], loop_ops_per_sec[NUM_ACTIVITY];
+
+static void report_loops() {
+  int act;
+  for (act=0; act<NUM_ACTIVITY; ++act)
+    if (get_loop(act))
+      printf("# Loop %-8s %3d per clock read, %7.1fns per block, %9.3g ops/s\n", activity_name[act],
+             unroll_ops[loop_unroll[act]], loop_block_nsec[act], loop_ops_per_sec[act]);
+}
+
+// Times every unroll of every available loop for a moment and keeps the
+// longest whose block fits in loop_bound_nsec (or the shortest, if none).
+static void calibrate_loops() {
+  int act, u;
+  for (act=0; act<NUM_ACTIVITY; ++act) {
+    double block_nsec[NUM_UNROLLS], ops_per_sec[NUM_UNROLLS];
+    int best = 0;
+    if (activity_loops[act]==NULL)
+      continue;
+    time_loop(act, 0, &block_nsec[0], &ops_per_sec[0]); // warm-up
+    for (u=0; u<NUM_UNROLLS; ++u) {
+      time_loop(act, u, &block_nsec[u], &ops_per_sec[u]);
+      if (block_nsec[u]<=loop_bound_nsec)
+        best = u;
+    }
+    set_loop(act, activity_loops[act][best]);
+    loop_unroll[act] = best;
+    loop_block_nsec[act] = block_nsec[best];
+    loop_ops_per_sec[act] = ops_per_sec[best];
+  }
+}
+
+
+static long long get_ticks_per_sec(const char *requested, float calib_sec) {
+  printf("# Calibrating (%f)\n", calib_sec);
+  init_timebase(requested, calib_sec);
+  printf("# Done\n");
+  return (long long)(timebase_info[timebase].ticks_per_sec+0.5);
+}
+
+static void coarse_sleep(musec_t total_musec, musec_t *start_musec, musec_t *end_musec) {
+  musec_t start = get_time_musec();
+  musec_t current = start;
+  musec_t end = start+total_musec;
 
   while (current<end) {
-    // wake up in time to crank shouting
-    musec_t desired = (dsp_refill_musec>0) ? MIN(end-current, dsp_refill_musec) : end-current;
+    musec_t desired = end-current;
     struct timespec req, rem;
     req.tv_sec = desired/MUSEC_SEC;
     req.tv_nsec = (desired%MUSEC_SEC)*1000;
@@ -442,36 +2219,2764 @@ static void coarse_sleep(musec_t total_musec, musec_t *start_musec, musec_t *end
       else
     error("nanosleep failed (req=%d.%09d): %s", req.tv_sec, req.tv_nsec, strerror(errno));
     }
-//    crank_shouting();
-    current = get_time_musec();
+    current = get_time_musec();
+  }
+  if (start_musec)
+    *start_musec = start;
+  if (end_musec)
+    *end_musec = current;
+}
+
+static musec_t get_sleep_granularity() {
+  musec_t start, end;
+  coarse_sleep(100, NULL, NULL);
+  coarse_sleep(100, &start, &end);
+  return end-start;
+}
+
+
+/****************************************************************************/
+// Idling
+//
+// idle_until() sleeps until a safety margin before the deadline and spins
+// for the rest with a low-power hint. The margin tracks a high percentile
+// of recently observed sleep overshoot, so it follows the kernel's actual
+// timer slack instead of a one-off granularity measurement. Deadlines
+// closer than the margin are not slept on at all.
+
+#define IDLE_HISTORY 128        // overshoot samples kept, must be power of 2
+#define IDLE_RANK 2             // margin = IDLE_RANK-th largest sample (~p99)
+#define IDLE_GUARD_NSEC 2000    // added on top of the learned overshoot
+
+// Every thread that idles learns its own margin, starting from the one
+// init_idle() measured on the activity thread.
+static _Thread_local tick_t idle_history[IDLE_HISTORY];
+static _Thread_local unsigned int idle_samples = 0;
+static _Thread_local tick_t idle_margin = 0;
+static _Thread_local long long idle_sleeps = 0, idle_spins = 0;
+static _Thread_local tick_t idle_spin_ticks = 0;
+static tick_t idle_initial_margin = 0;
+static tick_t wfe_ticks = 0;    // how long one wfe waits, 0 if not usable
+
+static inline void cpu_relax() {
+#if defined(__arm64__) || defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#elif defined(__i386__) || defined(__x86_64__)
+  asm volatile("pause" ::: "memory");
+#endif
+}
+
+static inline void cpu_wait_event() {
+#if defined(__arm64__) || defined(__aarch64__)
+  asm volatile("wfe" ::: "memory");
+#else
+  cpu_relax();
+#endif
+}
+
+static void learn_overshoot(tick_t overshoot) {
+  tick_t top[IDLE_RANK] = {0};
+  unsigned int i, j, n;
+  idle_history[idle_samples++ & (IDLE_HISTORY-1)] = MAX(overshoot, 0);
+  n = MIN(idle_samples, IDLE_HISTORY);
+  for (i=0; i<n; ++i) {
+    tick_t x = idle_history[i];
+    for (j=0; j<IDLE_RANK; ++j) {
+      if (x > top[j]) {
+        tick_t t = top[j]; top[j] = x; x = t;
+      }
+    }
+  }
+  idle_margin = top[MIN(n,IDLE_RANK)-1] + IDLE_GUARD_NSEC*ticks_per_sec/1000000000LL;
+}
+
+// Sleep until the given tick, relative to now. Uses an absolute
+// clock_nanosleep where available so EINTR cannot stretch the sleep.
+static void sleep_ticks(tick_t now, tick_t wake) {
+#ifdef TIMER_ABSTIME
+  struct timespec req;
+  long long nsec;
+  int err;
+  clock_gettime(CLOCK_MONOTONIC, &req);
+  nsec = (long long)req.tv_sec*1000000000LL + req.tv_nsec + (long long)((wake-now)*1e9/ticks_per_sec);
+  req.tv_sec = nsec/1000000000LL;
+  req.tv_nsec = nsec%1000000000LL;
+  while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL))==EINTR)
+    ;
+  if (err!=0)
+    error("clock_nanosleep failed: %s", strerror(err));
+#else
+  coarse_sleep((wake-now)*MUSEC_SEC/ticks_per_sec, NULL, NULL);
+#endif
+}
+
+static void idle_until(tick_t deadline) {
+  tick_t now, spin_start;
+  rdtscll(now);
+  if (deadline-now > idle_margin) {
+    tick_t wake = deadline-idle_margin;
+    sleep_ticks(now, wake);
+    rdtscll(now);
+    learn_overshoot(now-wake);
+    ++idle_sleeps;
+  }
+  if (now >= deadline)
+    return;
+  spin_start = now;
+  while (now < deadline) {
+    if (wfe_ticks>0 && deadline-now > 2*wfe_ticks)
+      cpu_wait_event();
+    else
+      cpu_relax();
+    rdtscll(now);
+  }
+  ++idle_spins;
+  idle_spin_ticks += now-spin_start;
+}
+
+static void init_idle() {
+  int i;
+  tick_t now;
+#if defined(__arm64__) || defined(__aarch64__)
+  // wfe only returns on an event; with the kernel's event stream that is
+  // every ~100us. Use it for long spins only if it reliably comes back
+  // well within the sleep margin.
+  tick_t before, after, longest = 0;
+  asm volatile("sevl; wfe" ::: "memory");
+  for (i=0; i<16; ++i) {
+    rdtscll(before);
+    cpu_wait_event();
+    rdtscll(after);
+    longest = MAX(longest, after-before);
+  }
+  if (longest < ticks_per_sec/2000)
+    wfe_ticks = longest;
+#endif
+  idle_margin = sleep_granularity*ticks_per_sec/MUSEC_SEC;
+  for (i=0; i<32; ++i) {
+    rdtscll(now);
+    sleep_ticks(now, now+ticks_per_sec/10000);
+    learn_overshoot(read_ticks()-(now+ticks_per_sec/10000));
+  }
+  idle_initial_margin = idle_margin;
+  printf("# Idle margin %.1fus", 1e6*idle_margin/ticks_per_sec);
+  if (wfe_ticks>0)
+    printf(", wfe %.1fus", 1e6*wfe_ticks/ticks_per_sec);
+  printf("\n");
+}
+
+static void inherit_idle() {
+  idle_margin = idle_initial_margin;
+}
+
+static void report_idle() {
+  printf("# Idle: %lld sleeps, %lld spins averaging %.1fus, margin %.1fus\n",
+         idle_sleeps, idle_spins, idle_spins ? 1e6*idle_spin_ticks/idle_spins/ticks_per_sec : 0.0,
+         1e6*idle_margin/ticks_per_sec);
+}
+
+
+/****************************************************************************/
+// Scheduling
+//
+// A run is compiled up front into a timeline: a flat array of steps whose
+// start and end are absolute tick offsets from the start of the run. Each
+// step ends at its deadline no matter when it actually started, so logging,
+// say() and sleep overshoot never accumulate into drift.
+
+// What each worker does during one step, for runs that give cores
+// different activities. Workers not covered sleep.
+struct mix {
+  const char *name;
+  activity_t activity[MAX_WORKERS];
+};
+
+struct step {
+  activity_t activity;     // for a mix: the first activity that is not SLEEP
+  const struct mix *mix;   // NULL: every worker does activity
+  const struct pwm *pwm;   // NULL: activity runs throughout the step
+  const char *label;       // printed when the step starts, may be NULL
+  tick_t start;            // ticks after the timeline's origin
+  tick_t end;
+};
+
+struct timeline {
+  struct step *steps;
+  int length, capacity;
+  int loop_start;     // steps[loop_start..length) repeat forever, -1 if none
+  tick_t period;      // length of the repeated part
+  double end_sec;     // unscaled end of the last step, while building
+  const char *label;  // pending label for the next step
+};
+
+static tick_t sec_to_ticks(double sec) {
+  return (tick_t)llround(sec*slowdown*ticks_per_sec);
+}
+
+static void sched_init(struct timeline *tl) {
+  memset(tl, 0, sizeof(*tl));
+  tl->loop_start = -1;
+}
+
+static void sched_add(struct timeline *tl, activity_t act, double sec) {
+  struct step *step;
+  if (act!=A_SLEEP && get_loop(act)==NULL)
+    error("Activity %s is not supported on this arch", activity_name[act]);
+  if (tl->length==tl->capacity) {
+    tl->capacity = tl->capacity ? 2*tl->capacity : 256;
+    tl->steps = realloc(tl->steps, tl->capacity*sizeof(struct step));
+    if (tl->steps==NULL)
+      error("sched_add: realloc failed");
+  }
+  step = &tl->steps[tl->length++];
+  step->activity = act;
+  step->mix = NULL;
+  step->pwm = NULL;
+  step->label = tl->label;
+  // Convert cumulative time rather than each duration, so rounding to
+  // ticks cannot accumulate either.
+  step->start = sec_to_ticks(tl->end_sec);
+  tl->end_sec += sec;
+  step->end = sec_to_ticks(tl->end_sec);
+  tl->label = NULL;
+}
+
+static void sched_add_mix(struct timeline *tl, const struct mix *mix, double sec) {
+  int k;
+  activity_t act = A_SLEEP;
+  for (k=0; k<MAX_WORKERS && act==A_SLEEP; ++k)
+    act = mix->activity[k];
+  sched_add(tl, act, sec);
+  tl->steps[tl->length-1].mix = mix;
+}
+
+// A PWM step switches its activity on and off at a fixed carrier period,
+// with a duty cycle that may ramp linearly over the step. The switching
+// edges are worked out here, as tick offsets from the step's start, so at
+// run time each one costs only the deadline compare of the loop or idle.
+#define PWM_MAX_PERIODS (1<<24)
+
+struct pwm {
+  char name[48];
+  activity_t activity;
+  double period_sec, duty0, duty1, sec;  // duties in percent
+  int chirp;       // CHIRP_LINEAR or CHIRP_LOG: periods follow a sweep instead
+  double f0, f1;
+  int periods;
+  tick_t *edges;   // [2*periods]: when each period's activity stops, when the period ends
+};
+
+enum {CHIRP_NONE, CHIRP_LINEAR, CHIRP_LOG};
+
+static struct pwm *alloc_pwm(activity_t act, double sec, int periods) {
+  struct pwm *pwm = calloc(1, sizeof(struct pwm));
+  if (pwm==NULL)
+    error("alloc_pwm: malloc failed");
+  if (periods>PWM_MAX_PERIODS)
+    error("PWM step of %gsec has more than %d periods", sec, PWM_MAX_PERIODS);
+  pwm->activity = act;
+  pwm->sec = sec;
+  pwm->periods = periods;
+  if ((pwm->edges = malloc(2*periods*sizeof(tick_t)))==NULL)
+    error("alloc_pwm: malloc failed");
+  return pwm;
+}
+
+static struct pwm *make_pwm(activity_t act, double period_sec, double duty0, double duty1, double sec) {
+  struct pwm *pwm = alloc_pwm(act, sec, (int)MIN(ceil(sec/period_sec), PWM_MAX_PERIODS+1.0));
+  double period_ticks = period_sec*slowdown*ticks_per_sec, duty;
+  int i;
+  pwm->period_sec = period_sec;
+  pwm->duty0 = duty0;
+  pwm->duty1 = duty1;
+  for (i=0; i<pwm->periods; ++i) {
+    duty = pwm->periods>1 ? duty0 + (duty1-duty0)*i/(pwm->periods-1) : duty0;
+    pwm->edges[2*i] = llround((i+duty/100)*period_ticks);
+    pwm->edges[2*i+1] = llround((i+1)*period_ticks);
+  }
+  if (duty0==duty1)
+    snprintf(pwm->name, sizeof(pwm->name), "%s/%gus/%g%%", activity_name[act], period_sec*1e6, duty0);
+  else
+    snprintf(pwm->name, sizeof(pwm->name), "%s/%gus/%g-%g%%", activity_name[act], period_sec*1e6, duty0, duty1);
+  return pwm;
+}
+
+// A chirp is a PWM at 50% duty whose frequency sweeps from f0 to f1 over
+// the step, linearly or exponentially in time. Period i starts when the
+// sweep's phase reaches i cycles, so the edges come from inverting the
+// phase (see rattle-log.h).
+static double chirp_time(const struct pwm *pwm, double cycles) {
+  double k = (pwm->f1-pwm->f0)/pwm->sec, t;
+  if (pwm->f1==pwm->f0)
+    t = cycles/pwm->f0;
+  else if (pwm->chirp==CHIRP_LOG)
+    t = pwm->sec*log1p(cycles*log(pwm->f1/pwm->f0)/(pwm->f0*pwm->sec))/log(pwm->f1/pwm->f0);
+  else
+    t = 2*cycles/(pwm->f0+sqrt(pwm->f0*pwm->f0+2*k*cycles));
+  return t;
+}
+
+static struct pwm *make_chirp(activity_t act, double f0, double f1, double sec, int kind) {
+  double cycles = kind==CHIRP_LOG && f1!=f0 ? (f1-f0)*sec/log(f1/f0) : (f0+f1)/2*sec;
+  struct pwm *pwm = alloc_pwm(act, sec, (int)MIN(ceil(cycles), PWM_MAX_PERIODS+1.0));
+  double scale = slowdown*ticks_per_sec;
+  int i;
+  pwm->duty0 = pwm->duty1 = 50;
+  pwm->chirp = kind;
+  pwm->f0 = f0;
+  pwm->f1 = f1;
+  for (i=0; i<pwm->periods; ++i) {
+    pwm->edges[2*i] = llround(MIN(chirp_time(pwm, i+0.5), sec)*scale);
+    pwm->edges[2*i+1] = llround(MIN(chirp_time(pwm, i+1), sec)*scale);
+  }
+  snprintf(pwm->name, sizeof(pwm->name), "%s/chirp/%g-%gHz%s", activity_name[act], f0, f1,
+           kind==CHIRP_LOG ? "/log" : "");
+  return pwm;
+}
+
+static void sched_add_pwm(struct timeline *tl, const struct pwm *pwm) {
+  sched_add(tl, pwm->activity, pwm->sec);
+  tl->steps[tl->length-1].pwm = pwm;
+}
+
+// Where edge offset e (in ticks as compiled) falls, with the step stretched
+// by scale like its deadlines are.
+static inline tick_t pwm_due(tick_t start_tick, tick_t end_tick, tick_t e, double scale) {
+  return MIN(start_tick+(tick_t)(e*scale), end_tick);
+}
+
+// Runs m periods from edge, noting how late each transition was from
+// position head of the edge ring, unless head is -1.
+static void run_periods(loop_fn loop, const tick_t *edge, int m, tick_t start_tick, tick_t end_tick,
+                        double scale, long head) {
+  tick_t due, now;
+  int i;
+  if (head<0) {
+    for (i=0; i<m; ++i, edge+=2) {
+      loop(pwm_due(start_tick, end_tick, edge[0], scale));
+      idle_until(pwm_due(start_tick, end_tick, edge[1], scale));
+    }
+    return;
+  }
+  for (i=0; i<m; ++i, edge+=2) {
+    due = pwm_due(start_tick, end_tick, edge[0], scale);
+    loop(due);
+    rdtscll(now);
+    record_edge(head, 2*i, now-due);
+    due = pwm_due(start_tick, end_tick, edge[1], scale);
+    idle_until(due);
+    rdtscll(now);
+    record_edge(head, 2*i+1, now-due);
+  }
+}
+
+// The last period is cut short by the step's end. With record set, a
+// chirp notes how late every transition was in the log's edge ring, a
+// block at a time, and returns how many it recorded. If the ring fills up,
+// the rest of the step goes unrecorded.
+static int run_pwm(const struct pwm *pwm, tick_t start_tick, tick_t end_tick, double scale, int record) {
+  loop_fn loop = get_loop(pwm->activity);
+  int i, m, recorded = 0;
+  long head = -1;
+  record = record && pwm->chirp;
+  for (i=0; i<pwm->periods; i+=m) {
+    m = record ? MIN(pwm->periods-i, RLOG_EDGES_MAX/2) : pwm->periods-i;
+    if (record && (head = reserve_log_edges(2*m))<0) {
+      log_edges_dropped += 2*(pwm->periods-i);
+      note("Edge ring full: %d chirp transitions not recorded", 2*(pwm->periods-i));
+      record = 0;
+    }
+    run_periods(loop, pwm->edges+2*i, m, start_tick, end_tick, scale, head);
+    if (head>=0) {
+      tell_log_edges(2*m);
+      recorded += 2*m;
+      head = -1;
+    }
+  }
+  return recorded;
+}
+
+// Pseudo-random chip sequences: one period of a maximal-length LFSR, or a
+// Gold code made from a preferred pair of them, with every chip a step of
+// one activity for 1 and another for 0. Runs of equal chips become one
+// step. Everything is expanded here, so nothing draws random numbers while
+// the timeline runs.
+#define SEQ_MAX_DEGREE 18
+
+// Feedback taps, as the exponents of the polynomial besides 0
+static const int mseq_taps[SEQ_MAX_DEGREE+1][5] = {
+  [2] = {2,1}, [3] = {3,2}, [4] = {4,3}, [5] = {5,3}, [6] = {6,5}, [7] = {7,6},
+  [8] = {8,6,5,4}, [9] = {9,5}, [10] = {10,7}, [11] = {11,9}, [12] = {12,6,4,1},
+  [13] = {13,4,3,1}, [14] = {14,5,3,1}, [15] = {15,14}, [16] = {16,15,13,4},
+  [17] = {17,14}, [18] = {18,11},
+};
+
+// Preferred pairs; there are none for degrees that are multiples of 4
+static const int gold_taps[SEQ_MAX_DEGREE+1][2][5] = {
+  [5] = {{5,2}, {5,4,3,2}}, [6] = {{6,1}, {6,5,2,1}}, [7] = {{7,3}, {7,3,2,1}},
+  [9] = {{9,4}, {9,6,4,3}}, [10] = {{10,3}, {10,8,3,2}}, [11] = {{11,2}, {11,8,5,2}},
+};
+
+static uint32_t taps_mask(const int *taps, int degree) {
+  uint32_t mask = 0;
+  for (; *taps; ++taps)
+    mask |= 1u << (degree - *taps);
+  return mask;
+}
+
+static inline int lfsr_next(uint32_t *state, uint32_t taps, int degree) {
+  int out = *state & 1;
+  *state = (*state >> 1) | (uint32_t)__builtin_parity(*state & taps) << (degree-1);
+  return out;
+}
+
+#define SEQ_BIT(seq,k) ((seq)->bits[(k)/8] >> ((k)%8) & 1)
+
+// seed2 is only used by Gold codes. Both seeds must be non-zero below 2^degree.
+static struct log_sequence *make_sequence(int kind, int degree, uint32_t seed, uint32_t seed2,
+                                          activity_t one, activity_t zero, double chip_sec) {
+  struct log_sequence *seq = malloc(sizeof(struct log_sequence));
+  uint32_t a, b;
+  int k;
+  if (seq==NULL)
+    error("make_sequence: malloc failed");
+  seq->kind = kind;
+  seq->degree = degree;
+  seq->chips = (1<<degree)-1;
+  seq->seed = a = seed;
+  seq->seed2 = b = kind==RLOG_SEQ_GOLD ? seed2 : 0;
+  seq->taps = taps_mask(kind==RLOG_SEQ_GOLD ? gold_taps[degree][0] : mseq_taps[degree], degree);
+  seq->taps2 = kind==RLOG_SEQ_GOLD ? taps_mask(gold_taps[degree][1], degree) : 0;
+  seq->one = one;
+  seq->zero = zero;
+  seq->chip_sec = chip_sec;
+  if ((seq->bits = calloc((seq->chips+7)/8, 1))==NULL)
+    error("make_sequence: calloc failed");
+  for (k=0; k<seq->chips; ++k) {
+    int bit = lfsr_next(&a, seq->taps, degree);
+    if (kind==RLOG_SEQ_GOLD)
+      bit ^= lfsr_next(&b, seq->taps2, degree);
+    seq->bits[k/8] |= bit << (k%8);
+  }
+  return seq;
+}
+
+static void sched_add_sequence(struct timeline *tl, const struct log_sequence *seq) {
+  int k, run;
+  for (k=0; k<seq->chips; k+=run) {
+    for (run=1; k+run<seq->chips && SEQ_BIT(seq, k+run)==SEQ_BIT(seq, k); ++run)
+      ;
+    sched_add(tl, SEQ_BIT(seq, k) ? seq->one : seq->zero, run*seq->chip_sec);
+  }
+}
+
+static const char *step_name(const struct step *step) {
+  if (step->pwm)
+    return step->pwm->name;
+  return step->mix ? step->mix->name : activity_name[step->activity];
+}
+
+// A_NONE if there is no such activity.
+static activity_t activity_by_name(const char *name, size_t len) {
+  int a;
+  for (a=A_SLEEP; a<NUM_ACTIVITY; ++a)
+    if (strlen(activity_name[a])==len && strncmp(name, activity_name[a], len)==0)
+      return a;
+  return A_NONE;
+}
+
+// Attach a message to the next step added, printed when it starts.
+static void sched_label(struct timeline *tl, const char *format, ...) {
+  va_list ap;
+  char *label = malloc(128);
+  if (label==NULL)
+    error("sched_label: malloc failed");
+  va_start(ap, format);
+  vsnprintf(label, 128, format, ap);
+  va_end(ap);
+  tl->label = label;
+}
+
+// Everything added after this call repeats forever.
+static void sched_loop(struct timeline *tl) {
+  tl->loop_start = tl->length;
+}
+
+static void sched_finish(struct timeline *tl) {
+  if (tl->loop_start>=tl->length)
+    tl->loop_start = -1;
+  if (tl->loop_start>=0)
+    tl->period = sec_to_ticks(tl->end_sec) - tl->steps[tl->loop_start].start;
+}
+
+
+/****************************************************************************/
+// Hardware counters
+//
+// With --perf the activity thread counts cycles, instructions, last-level
+// cache misses, branch misses and backend stall cycles in user mode over
+// every step it runs, using one perf_event group. Counters the kernel or CPU
+// do not offer are left out of the group and logged as missing. On x86 the
+// counters are read with rdpmc through each event's mmap'd page; elsewhere,
+// or when the kernel does not allow that, with one read() of the group.
+// Linux only.
+
+static int perf_counting = 0;
+static struct log_perf perf_before, perf_delta;
+static int perf_pending;                   // perf_delta not yet logged
+static int perf_slot[RLOG_PERF_COUNTERS];  // position in a group read, -1: not open
+
+#if defined(__linux__)
+static const struct {
+  uint64_t config;
+  const char *name;
+} perf_events[RLOG_PERF_COUNTERS] = {
+  {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+  {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+  {PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+  {PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+  {PERF_COUNT_HW_STALLED_CYCLES_BACKEND, "backend stalls"},
+};
+static int perf_fd[RLOG_PERF_COUNTERS];
+static int perf_group_size;
+static struct perf_event_mmap_page *perf_page[RLOG_PERF_COUNTERS];
+static int perf_user_read;                 // rdpmc works for every open counter
+
+static int open_counter(uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = group<0;               // the leader starts the group
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline uint64_t rdpmc(uint32_t counter) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+  return lo | (uint64_t)hi<<32;
+}
+
+// The self-monitoring protocol from linux/perf_event.h: retry until the
+// kernel did not update the page while we read it.
+static inline int read_counter_user(const volatile struct perf_event_mmap_page *pc, int64_t *value) {
+  uint32_t seq, idx;
+  int64_t count;
+  do {
+    seq = pc->lock;
+    atomic_signal_fence(memory_order_seq_cst);
+    idx = pc->index;
+    count = pc->offset;
+    if (idx!=0) {
+      int64_t pmc = rdpmc(idx-1);
+      count += (pmc << (64-pc->pmc_width)) >> (64-pc->pmc_width);
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+  } while (pc->lock!=seq);
+  *value = count;
+  return 1;
+}
+#endif
+
+static void perf_read(struct log_perf *perf) {
+  uint64_t buf[1+RLOG_PERF_COUNTERS];
+  int c;
+#if defined(__i386__) || defined(__x86_64__)
+  if (perf_user_read) {
+    for (c=0; c<RLOG_PERF_COUNTERS; ++c)
+      if (perf_slot[c]>=0)
+        read_counter_user(perf_page[c], &perf->delta[c]);
+    return;
+  }
+#endif
+  if (read(perf_fd[RLOG_PERF_CYCLES], buf, (1+perf_group_size)*sizeof(uint64_t))<=0)
+    error("Cannot read hardware counters: %s", strerror(errno));
+  for (c=0; c<RLOG_PERF_COUNTERS; ++c)
+    if (perf_slot[c]>=0)
+      perf->delta[c] = buf[1+perf_slot[c]];
+}
+
+static void start_perf() {
+  long page_size = sysconf(_SC_PAGESIZE);
+  int c;
+  if (!perf_counting)
+    return;
+  perf_user_read = 1;
+  for (c=0; c<RLOG_PERF_COUNTERS; ++c) {
+    perf_slot[c] = -1;
+    perf_fd[c] = open_counter(perf_events[c].config, c==RLOG_PERF_CYCLES ? -1 : perf_fd[RLOG_PERF_CYCLES]);
+    if (perf_fd[c]<0) {
+      if (c==RLOG_PERF_CYCLES) {
+        printf("# WARNING: Cannot count %s (%s); --perf disabled\n", perf_events[c].name, strerror(errno));
+        perf_counting = 0;
+        return;
+      }
+      note("No %s counter: %s", perf_events[c].name, strerror(errno));
+      continue;
+    }
+    perf_slot[c] = perf_group_size++;
+    perf_page[c] = mmap(NULL, page_size, PROT_READ, MAP_SHARED, perf_fd[c], 0);
+    if (perf_page[c]==MAP_FAILED || !perf_page[c]->cap_user_rdpmc)
+      perf_user_read = 0;
+  }
+#if !defined(__i386__) && !defined(__x86_64__)
+  perf_user_read = 0;
+#endif
+  ioctl(perf_fd[RLOG_PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  printf("# Counting %d hardware events with %s\n", perf_group_size, perf_user_read ? "rdpmc" : "read()");
+}
+#else
+static void perf_read(struct log_perf *perf) {
+}
+
+static void start_perf() {
+  if (perf_counting)
+    printf("# WARNING: --perf needs Linux perf events; disabled\n");
+  perf_counting = 0;
+}
+#endif
+
+// Around the activity loop of the activity thread
+static inline void perf_begin() {
+  if (perf_counting)
+    perf_read(&perf_before);
+}
+
+static inline void perf_end() {
+  struct log_perf after;
+  int c;
+  if (!perf_counting)
+    return;
+  perf_read(&after);
+  for (c=0; c<RLOG_PERF_COUNTERS; ++c)
+    perf_delta.delta[c] = perf_slot[c]>=0 ? after.delta[c]-perf_before.delta[c] : RLOG_PERF_MISSING;
+  perf_pending = 1;
+}
+
+
+/****************************************************************************/
+// Multi-core engine
+//
+// With --threads or --cpus every step runs on several cores at once. The
+// activity thread is worker 0 and coordinates: it announces each step, and
+// at the step's start deadline releases the other workers, which spin on a
+// shared generation counter for the last few microseconds. All of them run
+// until the same absolute end deadline and report when they actually
+// started and stopped; perform() logs that per core. Only the coordinator
+// talks to say() and the log, which are single-producer.
+
+#define WORKER_RELEASE_NSEC 20000  // workers start spinning this early
+#define WORKER_SPIN_POLLS 20000    // between-step polls before backing off
+
+struct worker {
+  _Alignas(64) int cpu;
+  pthread_t thread;
+  tick_t started, ended;
+  atomic_ulong finished;         // generation of the last step finished
+};
+
+static struct worker workers[MAX_WORKERS];
+static int num_workers = 1;
+static _Alignas(64) atomic_ulong engine_announced;  // step generation announced
+static _Alignas(64) atomic_ulong engine_released;   // step generation released
+static const struct step *engine_step;              // NULL: workers exit
+static tick_t engine_start, engine_end;
+static double engine_scale;                         // of the step's PWM edges
+
+// Parses "0-3,8,10-11" into cpus; returns how many.
+static int parse_cpu_list(const char *list, int *cpus, int max) {
+  int n = 0;
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+    if (end==p || lo<0)
+      error("Bad CPU list: %s", list);
+    if (*end=='-')
+      hi = strtol(end+1, &end, 10);
+    if (hi<lo)
+      error("Bad CPU list: %s", list);
+    for (; lo<=hi; ++lo) {
+      if (n==max)
+        error("Too many CPUs in %s (at most %d)", list, max);
+      cpus[n++] = lo;
+    }
+    if (*end==',')
+      ++end;
+    else if (*end)
+      error("Bad CPU list: %s", list);
+    p = end;
+  }
+  return n;
+}
+
+static void pin_thread_to_cpu(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)!=0)
+    error("Cannot pin thread to CPU %d", cpu);
+#elif defined(__APPLE__)
+  // Darwin has no hard affinity; distinct tags at least ask the scheduler
+  // to keep threads apart. iOS ignores them.
+  thread_affinity_policy_data_t policy = {cpu+1};
+  thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                    (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#endif
+}
+
+static inline activity_t step_activity(const struct step *step, int worker) {
+  return step->mix ? step->mix->activity[worker] : step->activity;
+}
+
+// Parses "MUL:0-3+MEMORY:4-7": an activity for each listed CPU, which must
+// be among the cpus the engine runs on. Other cores sleep.
+static struct mix *parse_mix(const char *spec, const int *cpus, int ncpus) {
+  struct mix *mix = malloc(sizeof(struct mix));
+  const char *p = spec;
+  int k, c, part[MAX_WORKERS];
+  if (mix==NULL)
+    error("parse_mix: malloc failed");
+  mix->name = spec;
+  for (k=0; k<MAX_WORKERS; ++k)
+    mix->activity[k] = A_SLEEP;
+  while (*p) {
+    const char *colon = strchr(p, ':'), *plus = strchr(p, '+');
+    char list[256];
+    activity_t act;
+    int n;
+    if (plus==NULL)
+      plus = p+strlen(p);
+    if (colon==NULL || colon>plus || plus-colon-1 >= (long)sizeof(list))
+      error("Bad mix (want ACTIVITY:CPUS+...): %s", spec);
+    act = activity_by_name(p, colon-p);
+    if (act==A_NONE)
+      error("Unknown activity in mix %s: %.*s", spec, (int)(colon-p), p);
+    if (act!=A_SLEEP && get_loop(act)==NULL)
+      error("Activity %s is not supported on this arch", activity_name[act]);
+    memcpy(list, colon+1, plus-colon-1);
+    list[plus-colon-1] = '\0';
+    n = parse_cpu_list(list, part, MAX_WORKERS);
+    for (c=0; c<n; ++c) {
+      for (k=0; k<ncpus && cpus[k]!=part[c]; ++k)
+        ;
+      if (k==ncpus)
+        error("Mix %s uses CPU %d, which is not in --cpus", spec, part[c]);
+      mix->activity[k] = act;
+    }
+    p = *plus ? plus+1 : plus;
+  }
+  return mix;
+}
+
+// Wait for a step to be announced. Steps follow each other closely, so
+// spin at first; back off to sleeping if the coordinator is held up.
+static void wait_for_announcement(unsigned long gen) {
+  struct timespec nap = {0, 50000};
+  long polls = 0;
+  while (atomic_load_explicit(&engine_announced, memory_order_acquire)!=gen) {
+    if (++polls<WORKER_SPIN_POLLS)
+      cpu_relax();
+    else
+      nanosleep(&nap, NULL);
+  }
+}
+
+// Run worker k's share of the announced step.
+static void run_share(int k, unsigned long gen) {
+  struct worker *w = &workers[k];
+  activity_t act = step_activity(engine_step, k);
+  if (act==A_SLEEP) {
+    idle_until(engine_end);
+    w->started = w->ended = 0;
+    return;
+  }
+  idle_until(engine_start - WORKER_RELEASE_NSEC*ticks_per_sec/1000000000LL);
+  while (atomic_load_explicit(&engine_released, memory_order_acquire)!=gen)
+    cpu_relax();
+  rdtscll(w->started);
+  if (engine_step->pwm)
+    run_pwm(engine_step->pwm, engine_start, engine_end, engine_scale, 0);
+  else
+    get_loop(act)(engine_end);
+  rdtscll(w->ended);
+}
+
+static void *worker_main(void *arg) {
+  int k = (struct worker *)arg - workers;
+  unsigned long gen = 0;
+  pin_thread_to_cpu(workers[k].cpu);
+  inherit_idle();
+  coherence_rank = k;
+  while (1) {
+    wait_for_announcement(++gen);
+    if (engine_step==NULL)
+      break;
+    run_share(k, gen);
+    atomic_store_explicit(&workers[k].finished, gen, memory_order_release);
+  }
+  return NULL;
+}
+
+static void start_engine(const int *cpus, int n) {
+  int k;
+  num_workers = n;
+  for (k=0; k<n; ++k)
+    workers[k].cpu = cpus[k];
+  pin_thread_to_cpu(cpus[0]);
+  for (k=1; k<n; ++k)
+    if (pthread_create(&workers[k].thread, NULL, worker_main, &workers[k])!=0)
+      error("Cannot start worker thread for CPU %d", cpus[k]);
+  if (n>1) {
+    printf("# Running on %d cores:", n);
+    for (k=0; k<n; ++k)
+      printf(" %d", cpus[k]);
+    printf("\n");
+  }
+}
+
+// Coordinator side of one step on all workers: fills in the entry like
+// the single-core path in perform() does, plus each core's offsets.
+static void engine_perform(const struct step *step, tick_t start_tick, tick_t end_tick, double scale,
+                           struct log_entry *entry, struct log_cores *cores) {
+  unsigned long gen = atomic_load_explicit(&engine_announced, memory_order_relaxed)+1;
+  activity_t act = step_activity(step, 0);
+  tick_t now;
+  int k;
+  engine_step = step;
+  engine_start = start_tick;
+  engine_end = end_tick;
+  engine_scale = scale;
+  atomic_store_explicit(&engine_announced, gen, memory_order_release);
+  idle_until(start_tick);
+  atomic_store_explicit(&engine_released, gen, memory_order_release);
+  rdtscll(now);
+  if (spiking)
+    spike(step->activity);
+  entry->late_nsec = (long long)((now-start_tick)*1e9/ticks_per_sec);
+  entry->start_musec = get_time_musec();
+  if (act==A_SLEEP) {
+    idle_until(end_tick);
+  } else {
+    rdtscll(workers[0].started);
+    perf_begin();
+    if (step->pwm)
+      entry->edges = run_pwm(step->pwm, start_tick, end_tick, scale, 1);
+    else
+      get_loop(act)(end_tick);
+    perf_end();
+    rdtscll(workers[0].ended);
+  }
+  for (k=1; k<num_workers; ++k)
+    while (atomic_load_explicit(&workers[k].finished, memory_order_acquire)!=gen)
+      cpu_relax();
+  rdtscll(now);
+  entry->end_musec = get_time_musec();
+  entry->over_nsec = (long long)((now-end_tick)*1e9/ticks_per_sec);
+  for (k=0; k<num_workers; ++k) {
+    if (step_activity(step, k)==A_SLEEP) {
+      cores->start_nsec[k] = cores->end_nsec[k] = RLOG_CORE_IDLE;
+    } else {
+      cores->start_nsec[k] = (int32_t)((workers[k].started-start_tick)*1e9/ticks_per_sec);
+      cores->end_nsec[k] = (int32_t)((workers[k].ended-end_tick)*1e9/ticks_per_sec);
+    }
+  }
+}
+
+static void finish_engine() {
+  int k;
+  if (num_workers<=1)
+    return;
+  engine_step = NULL;
+  atomic_fetch_add_explicit(&engine_announced, 1, memory_order_release);
+  for (k=1; k<num_workers; ++k)
+    pthread_join(workers[k].thread, NULL);
+}
+
+
+/****************************************************************************/
+// Partners
+//
+// --partners LIST pins a thread to each listed CPU for the coherence
+// activities. A partner waits for the activity thread to release it, the
+// same way engine workers wait for a step, and then runs the released loop
+// with the rank after the engine's. They start before calibration, so the
+// coherence loops are timed with the traffic they will see.
+
+static int partner_cpus[MAX_PARTNERS];
+static pthread_t partner_threads[MAX_PARTNERS];
+static const char *partner_list = "none";
+static atomic_int partner_stop;
+
+static void *partner_main(void *arg) {
+  int k = (int *)arg - partner_cpus;
+  unsigned long gen = 0, released;
+  struct timespec nap = {0, 50000};
+  long polls = 0;
+  pin_thread_to_cpu(partner_cpus[k]);
+  coherence_rank = num_workers+k;
+  while (!atomic_load_explicit(&partner_stop, memory_order_relaxed)) {
+    released = atomic_load_explicit(&partner_released, memory_order_acquire);
+    if (released==gen) {
+      if (++polls<WORKER_SPIN_POLLS)
+        cpu_relax();
+      else
+        nanosleep(&nap, NULL);
+      continue;
+    }
+    gen = released;
+    polls = 0;
+    // the shortest unroll: calibration may not have picked one yet
+    activity_loops[atomic_load_explicit(&partner_act, memory_order_relaxed)][0](
+      atomic_load_explicit(&partner_end, memory_order_relaxed));
+  }
+  return NULL;
+}
+
+// workers is how many engine workers there will be, for the ranks
+static void start_partners(const int *cpus, int n, int workers) {
+  int k;
+  num_partners = n;
+  num_workers = workers;
+  for (k=0; k<n; ++k) {
+    partner_cpus[k] = cpus[k];
+    if (pthread_create(&partner_threads[k], NULL, partner_main, &partner_cpus[k])!=0)
+      error("Cannot start partner thread for CPU %d", cpus[k]);
+  }
+  if (n>0) {
+    printf("# Coherence partners on %d cores:", n);
+    for (k=0; k<n; ++k)
+      printf(" %d", cpus[k]);
+    printf("\n");
+  }
+}
+
+static void finish_partners() {
+  int k;
+  atomic_store(&partner_stop, 1);
+  for (k=0; k<num_partners; ++k)
+    pthread_join(partner_threads[k], NULL);
+}
+
+
+/****************************************************************************/
+// Schedule files
+//
+// A schedule is a small line-based language that is expanded into a
+// timeline once, before anything runs:
+//
+//   # comment
+//   MUL 0.8                   an activity for a duration in seconds
+//   mix MUL:0-3+MEMORY:4-7 d  a per-core mix (see parse_mix)
+//   pwm MUL 100 10..90 d      MUL switched on and off every 100us, for
+//                             10% of the first period rising to 90% of
+//                             the last (one duty: no ramp)
+//   chirp MUL 100 2e4 d log   MUL switched on for half of every period of
+//                             a sweep from 100Hz to 20kHz, exponential in
+//                             time (linear: the default)
+//   prbs 10 1 1e-3 MUL SLEEP  a maximal-length sequence of degree 10 from
+//                             seed 1, each chip MUL (1) or SLEEP (0) for 1ms
+//   gold 10 1 5 1e-3 MUL ADD  likewise a Gold code, seeds 1 and 5
+//   set reps 10               a numeric variable
+//   say Activity set of $d    label the next step; $var prints a variable
+//   repeat reps { ... }       the block, a number of times
+//   if watch { ... }          the block if the variable is non-zero
+//   if !watch { ... }         ... or zero
+//   ramp d 8 1e-5 1.5@0.5 1.07@0.03 1.02 { ... }
+//                             the block with d=8, then d divided by the
+//                             first factor whose threshold d exceeds,
+//                             until d is no longer above 1e-5
+//   forever { ... }           the block, endlessly; must come last
+//
+// Durations and counts are a number or variable, optionally followed by
+// *x or /x. watch and exotic are predefined from the command line, and
+// --set name=value defines more. $name also substitutes text variables
+// (e.g. $mix) anywhere on a line. The modes selected by -t, -w, --mulsleep
+// and friends are the built-in schedules below.
+
+#define SCHED_MAX_VARS 64
+#define SCHED_MAX_MIXES 64
+#define SCHED_MAX_PWMS 64
+#define SCHED_MAX_SEQUENCES 16
+#define SCHED_MAX_TOKENS 16
+
+struct sched_var {
+  char name[32];
+  double value;
+  const char *text;    // if set, what $name expands to
+};
+
+struct sched_compiler {
+  struct timeline *tl;
+  const char *file;
+  char **lines;
+  int num_lines;
+  int depth;
+  int forever_done;
+  struct sched_var vars[SCHED_MAX_VARS];
+  int num_vars;
+  const int *cpus;
+  int num_cpus;
+  struct mix *mixes[SCHED_MAX_MIXES];  // parsed once, so the log names match
+  int num_mixes;
+  struct pwm *pwms[SCHED_MAX_PWMS];    // likewise, and repeats share the edges
+  int num_pwms;
+  struct log_sequence *sequences[SCHED_MAX_SEQUENCES];  // see sched_log_sequences()
+  int num_sequences;
+};
+
+struct builtin_schedule {
+  const char *name;
+  const char *banner;
+  const char *text;
+};
+
+static const struct builtin_schedule builtin_schedules[] = {
+  {"trial", "! Trial",
+   "forever {\n"
+   "  MUL 0.8\n"
+   "  SLEEP 0.4\n"
+   "  MEMORY 0.8\n"
+   "  SLEEP 0.4\n"
+   "}\n"},
+  {"mulsleep", "! MUL/SLEEP",
+   "forever {\n"
+   "  MUL 0.4\n"
+   "  SLEEP 0.2\n"
+   "}\n"},
+  {"mulfmul", "! MUL/FMUL/MUL_FMUL only",
+   "forever {\n"
+   "  MUL 1\n"
+   "  # FMUL 1\n"
+   "  # MUL_FMUL 1\n"
+   "  repeat 500 {\n"
+   "    MUL 0.001\n"
+   "    # FMUL 0.001\n"
+   "  }\n"
+   "  repeat 500 {\n"
+   "    MUL 0.0005\n"
+   "    # FMUL 0.0015\n"
+   "  }\n"
+   "  SLEEP 0.2\n"
+   "}\n"},
+  {"pwmsweep", "! MUL PWM duty sweep",
+   "forever {\n"
+   "  pwm MUL 100 0..100 10\n"
+   "  SLEEP 1\n"
+   "}\n"},
+  {"chirp", "! MUL chirp",
+   "forever {\n"
+   "  chirp MUL 100 20000 5 log\n"
+   "  SLEEP 1\n"
+   "}\n"},
+  {"prbs", "! MUL/SLEEP m-sequence",
+   "forever {\n"
+   "  prbs 10 1 0.001 MUL SLEEP\n"
+   "}\n"},
+  {"idle", "! Idle", ""},
+  {"justmem", "! Memory only",
+   "forever {\n"
+   "  MEMORY 1000\n"
+   "}\n"},
+  {"justmul", "! MUL only",
+   "forever {\n"
+   "  MUL 1000\n"
+   "}\n"},
+  {"mix", "! Mix/SLEEP",
+   "forever {\n"
+   "  mix $mix 0.8\n"
+   "  SLEEP 0.4\n"
+   "}\n"},
+  {"sweep", NULL,
+   "if !watch {\n"
+   "  MUL 30\n"
+   "  SLEEP 30\n"
+   "}\n"
+   "set first 8\n"
+   "set reps 10\n"
+   "if watch {\n"
+   "  set first 1\n"
+   "  set reps 3\n"
+   "}\n"
+   "ramp d first 0.00001 1.5@0.5 1.07@0.03 1.02 {\n"
+   "  say Activity set of $d sec\n"
+   "  MUL d\n"
+   "  # FMUL d\n"
+   "  ADD d\n"
+   "  MEMORY d\n"
+   "  PAUSE d\n"
+   "  if exotic {\n"
+   "    DIV2 d\n"
+   "    DIV8209 d\n"
+   "    MEMW0 d\n"
+   "    MEMW1 d\n"
+   "  }\n"
+   "  SLEEP d\n"
+   "}\n"
+   "ramp d 0.65925 0.00001 1.5@0.1 1.3@0.01 1.1 {\n"
+   "  say Resolution set of $d sec\n"
+   "  repeat reps {\n"
+   "    MUL d\n"
+   "    SLEEP d/2\n"
+   "  }\n"
+   "}\n"},
+};
+
+static const struct builtin_schedule *find_builtin_schedule(const char *name) {
+  unsigned int i;
+  for (i=0; i<sizeof(builtin_schedules)/sizeof(builtin_schedules[0]); ++i)
+    if (strcmp(builtin_schedules[i].name, name)==0)
+      return &builtin_schedules[i];
+  error("Unknown built-in schedule: %s", name);
+  return NULL;
+}
+
+static void sched_error(const struct sched_compiler *c, int line, const char *format, ...) {
+  va_list ap;
+  fprintf(error_stream(), "%s:%d: ", c->file, line+1);
+  va_start(ap, format);
+  vfprintf(error_stream(), format, ap);
+  va_end(ap);
+  fputc('\n', error_stream());
+  error_exit();
+}
+
+static struct sched_var *sched_var(struct sched_compiler *c, const char *name, int create) {
+  int i;
+  for (i=0; i<c->num_vars; ++i)
+    if (strcmp(c->vars[i].name, name)==0)
+      return &c->vars[i];
+  if (!create)
+    return NULL;
+  if (c->num_vars==SCHED_MAX_VARS || strlen(name)>=sizeof(c->vars[0].name))
+    error("Too many or too long schedule variables (%s)", name);
+  memset(&c->vars[c->num_vars], 0, sizeof(c->vars[0]));
+  strcpy(c->vars[c->num_vars].name, name);
+  return &c->vars[c->num_vars++];
+}
+
+static void sched_set(struct sched_compiler *c, const char *name, double value, const char *text) {
+  struct sched_var *var = sched_var(c, name, 1);
+  var->value = value;
+  var->text = text;
+}
+
+static double sched_atom(struct sched_compiler *c, int line, const char *token, size_t len) {
+  char buf[64], *end;
+  struct sched_var *var;
+  double value;
+  if (len==0 || len>=sizeof(buf))
+    sched_error(c, line, "bad number or variable: %s", token);
+  memcpy(buf, token, len);
+  buf[len] = '\0';
+  value = strtod(buf, &end);
+  if (*end=='\0')
+    return value;
+  if ((var = sched_var(c, buf, 0))==NULL)
+    sched_error(c, line, "unknown variable: %s", buf);
+  return var->value;
+}
+
+// NUMBER-OR-VAR [ (*|/) NUMBER-OR-VAR ]
+static double sched_expr(struct sched_compiler *c, int line, const char *token) {
+  const char *op = strpbrk(token+1, "*/");
+  double left, right;
+  if (op==NULL)
+    return sched_atom(c, line, token, strlen(token));
+  left = sched_atom(c, line, token, op-token);
+  right = sched_atom(c, line, op+1, strlen(op+1));
+  return *op=='*' ? left*right : left/right;
+}
+
+static const struct mix *sched_mix(struct sched_compiler *c, int line, const char *spec) {
+  int i;
+  for (i=0; i<c->num_mixes; ++i)
+    if (strcmp(c->mixes[i]->name, spec)==0)
+      return c->mixes[i];
+  if (c->num_mixes==SCHED_MAX_MIXES)
+    sched_error(c, line, "too many different mixes");
+  return c->mixes[c->num_mixes++] = parse_mix(strdup(spec), c->cpus, c->num_cpus);
+}
+
+// pwm ACTIVITY PERIOD_US DUTY[..DUTY] SECONDS
+static const struct pwm *sched_pwm(struct sched_compiler *c, int line, char **tok) {
+  activity_t act = activity_by_name(tok[1], strlen(tok[1]));
+  char *dots = strstr(tok[3], "..");
+  double period_sec = sched_expr(c, line, tok[2])*1e-6, duty0, duty1, sec;
+  int i;
+  if (act==A_NONE || act==A_SLEEP)
+    sched_error(c, line, "pwm needs an activity: %s", tok[1]);
+  if (get_loop(act)==NULL)
+    sched_error(c, line, "activity %s is not supported on this arch", tok[1]);
+  if (dots)
+    *dots = '\0';
+  duty0 = sched_expr(c, line, tok[3]);
+  duty1 = dots ? sched_expr(c, line, dots+2) : duty0;
+  sec = sched_expr(c, line, tok[4]);
+  if (!(duty0>=0 && duty0<=100 && duty1>=0 && duty1<=100))
+    sched_error(c, line, "pwm duty cycles are percentages");
+  if (!(period_sec*slowdown*ticks_per_sec>=2))
+    sched_error(c, line, "pwm period is too short: %gus", period_sec*1e6);
+  for (i=0; i<c->num_pwms; ++i) {
+    const struct pwm *pwm = c->pwms[i];
+    if (!pwm->chirp && pwm->activity==act && pwm->period_sec==period_sec && pwm->duty0==duty0 && pwm->duty1==duty1
+        && pwm->sec==sec)
+      return pwm;
+  }
+  if (c->num_pwms==SCHED_MAX_PWMS)
+    sched_error(c, line, "too many different pwm steps");
+  return c->pwms[c->num_pwms++] = make_pwm(act, period_sec, duty0, duty1, sec);
+}
+
+// chirp ACTIVITY F0_HZ F1_HZ SECONDS [linear|log]
+static const struct pwm *sched_chirp(struct sched_compiler *c, int line, char **tok, int ntok) {
+  activity_t act = activity_by_name(tok[1], strlen(tok[1]));
+  double f0 = sched_expr(c, line, tok[2]), f1 = sched_expr(c, line, tok[3]), sec = sched_expr(c, line, tok[4]);
+  int kind = CHIRP_LINEAR, i;
+  if (act==A_NONE || act==A_SLEEP)
+    sched_error(c, line, "chirp needs an activity: %s", tok[1]);
+  if (get_loop(act)==NULL)
+    sched_error(c, line, "activity %s is not supported on this arch", tok[1]);
+  if (ntok==6 && strcmp(tok[5], "log")==0)
+    kind = CHIRP_LOG;
+  else if (ntok==6 && strcmp(tok[5], "linear")!=0)
+    sched_error(c, line, "chirp sweeps are linear or log: %s", tok[5]);
+  if (!(f0>0 && f1>0 && sec>0))
+    sched_error(c, line, "chirp frequencies and duration must be positive");
+  if (!(slowdown*ticks_per_sec/MAX(f0, f1)>=4))
+    sched_error(c, line, "chirp frequency is too high: %gHz", MAX(f0, f1));
+  for (i=0; i<c->num_pwms; ++i) {
+    const struct pwm *pwm = c->pwms[i];
+    if (pwm->chirp==kind && pwm->activity==act && pwm->f0==f0 && pwm->f1==f1 && pwm->sec==sec)
+      return pwm;
+  }
+  if (c->num_pwms==SCHED_MAX_PWMS)
+    sched_error(c, line, "too many different pwm steps");
+  return c->pwms[c->num_pwms++] = make_chirp(act, f0, f1, sec, kind);
+}
+
+static activity_t sched_activity(struct sched_compiler *c, int line, const char *name) {
+  activity_t act = activity_by_name(name, strlen(name));
+  if (act==A_NONE)
+    sched_error(c, line, "unknown activity: %s", name);
+  if (act!=A_SLEEP && get_loop(act)==NULL)
+    sched_error(c, line, "activity %s is not supported on this arch", name);
+  return act;
+}
+
+// prbs DEGREE SEED CHIP_SEC ONE ZERO
+// gold DEGREE SEED SEED2 CHIP_SEC ONE ZERO
+static const struct log_sequence *sched_sequence(struct sched_compiler *c, int line, char **tok, int ntok) {
+  int kind = ntok==7 ? RLOG_SEQ_GOLD : RLOG_SEQ_MSEQ;
+  int degree = lround(sched_expr(c, line, tok[1]));
+  uint32_t seed = lround(sched_expr(c, line, tok[2]));
+  uint32_t seed2 = kind==RLOG_SEQ_GOLD ? lround(sched_expr(c, line, tok[3])) : 0;
+  double chip_sec = sched_expr(c, line, tok[ntok-3]);
+  activity_t one = sched_activity(c, line, tok[ntok-2]), zero = sched_activity(c, line, tok[ntok-1]);
+  struct log_sequence *seq;
+  int i;
+  if (degree<2 || degree>SEQ_MAX_DEGREE || (kind==RLOG_SEQ_GOLD && gold_taps[degree][0][0]==0))
+    sched_error(c, line, "no %s sequence of degree %d", tok[0], degree);
+  if (seed==0 || seed>>degree || (kind==RLOG_SEQ_GOLD && (seed2==0 || seed2>>degree)))
+    sched_error(c, line, "seeds must be between 1 and %d", (1<<degree)-1);
+  if (!(chip_sec>0))
+    sched_error(c, line, "bad chip duration: %s", tok[ntok-3]);
+  for (i=0; i<c->num_sequences; ++i) {
+    seq = c->sequences[i];
+    if (seq->kind==kind && seq->degree==degree && seq->seed==seed && seq->seed2==seed2 &&
+        seq->chip_sec==chip_sec && seq->one==one && seq->zero==zero)
+      return seq;
+  }
+  if (c->num_sequences==SCHED_MAX_SEQUENCES)
+    sched_error(c, line, "too many different sequences");
+  seq = c->sequences[c->num_sequences++] = make_sequence(kind, degree, seed, seed2, one, zero, chip_sec);
+  seq->offset_sec = c->tl->end_sec;
+  return seq;
+}
+
+// Replaces each $name in a line by the variable's text, or its value.
+static void sched_substitute(struct sched_compiler *c, int line, const char *in, char *out, size_t size) {
+  size_t n = 0;
+  while (*in && n+1<size) {
+    if (*in=='$') {
+      char name[32];
+      size_t len = 0;
+      struct sched_var *var;
+      ++in;
+      while ((isalnum((unsigned char)*in) || *in=='_') && len+1<sizeof(name))
+        name[len++] = *in++;
+      name[len] = '\0';
+      if ((var = sched_var(c, name, 0))==NULL)
+        sched_error(c, line, "unknown variable: $%s", name);
+      if (var->text)
+        n += snprintf(out+n, size-n, "%s", var->text);
+      else
+        n += snprintf(out+n, size-n, "%f", var->value);
+      n = MIN(n, size-1);
+    } else {
+      out[n++] = *in++;
+    }
+  }
+  out[n] = '\0';
+}
+
+// Index of the "}" closing the block opened on the given line.
+static int sched_block_end(struct sched_compiler *c, int open) {
+  int i, depth = 0;
+  for (i=open; i<c->num_lines; ++i) {
+    const char *p = c->lines[i];
+    size_t len;
+    while (isspace((unsigned char)*p))
+      ++p;
+    len = strlen(p);
+    while (len>0 && isspace((unsigned char)p[len-1]))
+      --len;
+    if (len>0 && *p!='#' && p[len-1]=='{')
+      ++depth;
+    else if (len==1 && *p=='}' && --depth==0)
+      return i;
+  }
+  sched_error(c, open, "block is not closed");
+  return -1;
+}
+
+static void sched_compile_lines(struct sched_compiler *c, int from, int to) {
+  int line;
+  for (line=from; line<to; ++line) {
+    char text[1024], *tok[SCHED_MAX_TOKENS], *p;
+    int ntok = 0, block = 0, end = 0;
+    activity_t act;
+
+    for (p=c->lines[line]; isspace((unsigned char)*p); ++p)
+      ;
+    if (*p=='#')
+      continue;
+    sched_substitute(c, line, c->lines[line], text, sizeof(text));
+    for (p=strtok(text, " \t\r\n"); p && ntok<SCHED_MAX_TOKENS; p=strtok(NULL, " \t\r\n"))
+      tok[ntok++] = p;
+    if (ntok==0)
+      continue;
+    if (c->forever_done)
+      sched_error(c, line, "nothing can follow a forever block");
+    if (strcmp(tok[ntok-1], "{")==0) {
+      block = 1;
+      end = sched_block_end(c, line);
+      --ntok;
+    }
+
+    if (strcmp(tok[0], "say")==0) {
+      // Keep the original spacing of the message.
+      sched_substitute(c, line, c->lines[line], text, sizeof(text));
+      p = strstr(text, "say")+3;
+      while (isspace((unsigned char)*p))
+        ++p;
+      p[strcspn(p, "\r\n")] = '\0';
+      sched_label(c->tl, "%s", p);
+    } else if (strcmp(tok[0], "set")==0 && ntok==3 && !block) {
+      sched_set(c, tok[1], sched_expr(c, line, tok[2]), NULL);
+    } else if (strcmp(tok[0], "mix")==0 && ntok==3 && !block) {
+      sched_add_mix(c->tl, sched_mix(c, line, tok[1]), sched_expr(c, line, tok[2]));
+    } else if (strcmp(tok[0], "pwm")==0 && ntok==5 && !block) {
+      sched_add_pwm(c->tl, sched_pwm(c, line, tok));
+    } else if (strcmp(tok[0], "chirp")==0 && (ntok==5 || ntok==6) && !block) {
+      sched_add_pwm(c->tl, sched_chirp(c, line, tok, ntok));
+    } else if (((strcmp(tok[0], "prbs")==0 && ntok==6) || (strcmp(tok[0], "gold")==0 && ntok==7)) && !block) {
+      sched_add_sequence(c->tl, sched_sequence(c, line, tok, ntok));
+    } else if (strcmp(tok[0], "repeat")==0 && ntok==2 && block) {
+      long n = lround(sched_expr(c, line, tok[1]));
+      ++c->depth;
+      while (n-- > 0)
+        sched_compile_lines(c, line+1, end);
+      --c->depth;
+    } else if (strcmp(tok[0], "if")==0 && ntok==2 && block) {
+      int negate = tok[1][0]=='!';
+      double value = sched_expr(c, line, tok[1]+negate);
+      if ((value!=0) != negate)
+        sched_compile_lines(c, line+1, end);
+    } else if (strcmp(tok[0], "forever")==0 && ntok==1 && block) {
+      if (c->depth>0)
+        sched_error(c, line, "forever cannot be nested");
+      sched_loop(c->tl);
+      ++c->depth;
+      sched_compile_lines(c, line+1, end);
+      --c->depth;
+      c->forever_done = 1;
+    } else if (strcmp(tok[0], "ramp")==0 && ntok>=5 && block) {
+      struct sched_var *var = sched_var(c, tok[1], 1);
+      double stop = sched_expr(c, line, tok[3]);
+      int i;
+      var->value = sched_expr(c, line, tok[2]);
+      var->text = NULL;
+      ++c->depth;
+      do {
+        double value = var->value, factor = 0;
+        sched_compile_lines(c, line+1, end);
+        for (i=4; i<ntok && factor==0; ++i) {
+          char *at = strchr(tok[i], '@');
+          if (at==NULL || value > sched_expr(c, line, at+1))
+            factor = strtod(tok[i], NULL);
+        }
+        if (factor<=1)
+          sched_error(c, line, "ramp needs a factor above 1 for %s=%g", var->name, value);
+        var->value = value/factor;
+      } while (var->value > stop);
+      --c->depth;
+    } else if (!block && ntok==2) {
+      act = activity_by_name(tok[0], strlen(tok[0]));
+      if (act==A_NONE)
+        sched_error(c, line, "unknown activity: %s", tok[0]);
+      if (act!=A_SLEEP && get_loop(act)==NULL)
+        sched_error(c, line, "activity %s is not supported on this arch", tok[0]);
+      sched_add(c->tl, act, sched_expr(c, line, tok[1]));
+    } else {
+      sched_error(c, line, "cannot parse: %s", c->lines[line]);
+    }
+    if (block)
+      line = end;
+  }
+}
+
+// Expands a schedule (the file's contents) into tl.
+static void compile_schedule(struct timeline *tl, const char *file, const char *source,
+                             struct sched_compiler *c) {
+  char *copy = strdup(source), *p;
+  int capacity = 64;
+  c->tl = tl;
+  c->file = file;
+  c->num_lines = 0;
+  c->depth = 0;
+  c->forever_done = 0;
+  c->lines = malloc(capacity*sizeof(char *));
+  if (copy==NULL || c->lines==NULL)
+    error("compile_schedule: malloc failed");
+  for (p=copy; p; ) {
+    char *nl = strchr(p, '\n');
+    if (c->num_lines==capacity) {
+      capacity *= 2;
+      c->lines = realloc(c->lines, capacity*sizeof(char *));
+      if (c->lines==NULL)
+        error("compile_schedule: realloc failed");
+    }
+    c->lines[c->num_lines++] = p;
+    if (nl)
+      *nl++ = '\0';
+    p = nl;
+  }
+  sched_compile_lines(c, 0, c->num_lines);
+  sched_finish(tl);
+  free(c->lines);
+  free(copy);
+}
+
+// The sequences go to the log from the activity thread, the only producer
+// of its sequence ring, once a compiled timeline is about to run.
+static void sched_log_sequences(const struct sched_compiler *c) {
+  int i;
+  for (i=0; i<c->num_sequences; ++i)
+    tell_log_sequence(c->sequences[i]);
+}
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "r");
+  char *buf = NULL;
+  size_t len = 0, capacity = 0, n;
+  if (f==NULL)
+    error("Cannot open %s: %s", path, strerror(errno));
+  do {
+    if (len+4096+1 > capacity) {
+      capacity = 2*capacity + 4096 + 1;
+      if ((buf = realloc(buf, capacity))==NULL)
+        error("read_file: realloc failed");
+    }
+    n = fread(buf+len, 1, 4096, f);
+    len += n;
+  } while (n>0);
+  fclose(f);
+  buf[len] = '\0';
+  return buf;
+}
+
+
+/****************************************************************************/
+// Replay
+//
+// --replay FILE runs the steps of an earlier run again, each starting and
+// ending at the offset from the first step that it actually did then, so
+// the recorded jitter is reproduced rather than the schedule it came from.
+// FILE is a binary --log or a dump's "> start end duration name" lines. It
+// is parsed before calibration and compiled into an ordinary timeline, so
+// replaying costs no more than running a schedule. After the run each step
+// is compared with its recording.
+
+struct replay_step {
+  double start, end;   // seconds after the first step's start
+  double wanted;       // scheduled duration, or the actual one if unknown
+  const char *name;
+};
+
+static struct replay_step *replay_steps;  // as recorded
+static int replay_length;
+
+static void add_replay_step(struct replay_step **steps, int *n, int *capacity,
+                            double start, double end, double wanted, const char *name) {
+  if (*n==*capacity) {
+    *capacity = *capacity ? 2**capacity : 256;
+    if ((*steps = realloc(*steps, *capacity*sizeof(struct replay_step)))==NULL)
+      error("add_replay_step: realloc failed");
+  }
+  (*steps)[*n].start = start;
+  (*steps)[*n].end = end;
+  (*steps)[*n].wanted = wanted;
+  (*steps)[(*n)++].name = name;
+}
+
+static void rebase_replay_steps(struct replay_step *steps, int n) {
+  double origin = n>0 ? steps[0].start : 0;
+  int k;
+  for (k=0; k<n; ++k) {
+    steps[k].start -= origin;
+    steps[k].end -= origin;
+  }
+}
+
+// Reads the steps of a binary log, relative to the first one's start
+static int read_log_steps(int fd, struct replay_step **steps) {
+  struct stat st;
+  const char *map, *p, *end;
+  const struct rlog_header *header;
+  const char **names = NULL;
+  unsigned int num_names = 0;
+  int n = 0, capacity = 0;
+  *steps = NULL;
+  if (fstat(fd, &st)!=0)
+    error("Cannot stat log file: %s", strerror(errno));
+  if (st.st_size < (off_t)sizeof(*header))
+    error("Log file too short");
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map==MAP_FAILED)
+    error("Cannot map log file: %s", strerror(errno));
+  header = (const struct rlog_header *)map;
+  if (strncmp(header->magic, RLOG_MAGIC, sizeof(header->magic))!=0 || header->version<1 || header->version>RLOG_VERSION)
+    error("Not a rattle log (or wrong version)");
+  end = map+st.st_size;
+  for (p=map+header->header_size; p+sizeof(struct rlog_record)<=end; p+=((const struct rlog_record *)p)->size) {
+    const struct rlog_record *rec = (const struct rlog_record *)p;
+    if (rec->type==RLOG_END || rec->size==0 || p+rec->size>end)
+      break;
+    if (rec->type==RLOG_NAME) {
+      const struct rlog_name *name = (const struct rlog_name *)rec;
+      if (name->id>=num_names) {
+        if ((names = realloc(names, (name->id+1)*sizeof(*names)))==NULL)
+          error("read_log_steps: realloc failed");
+        while (num_names<=name->id)
+          names[num_names++] = "?";
+      }
+      names[name->id] = strdup(name->name);
+    } else if (rec->type==RLOG_STEP) {
+      const struct rlog_step *step = (const struct rlog_step *)rec;
+      add_replay_step(steps, &n, &capacity, (double)step->start_musec/MUSEC_SEC, (double)step->end_musec/MUSEC_SEC,
+                      step->size>=sizeof(*step) ? step->wanted_nsec*1e-9 : (double)(step->end_musec-step->start_musec)/MUSEC_SEC,
+                      step->name<num_names ? names[step->name] : "?");
+    }
   }
-  if (start_musec)
-    *start_musec = start;
-  if (end_musec)
-    *end_musec = current;
+  munmap((void *)map, st.st_size);
+  free(names);
+  rebase_replay_steps(*steps, n);
+  return n;
 }
 
-static void perform_sleep(float sec) {
-  struct log_entry entry;
+static void read_replay(const char *path) {
+  char magic[sizeof(RLOG_MAGIC)] = {0}, *text, *line, *nl;
+  int fd = open(path, O_RDONLY), capacity = 0, n;
+  double start, end, sec;
+  if (fd<0)
+    error("Cannot open %s: %s", path, strerror(errno));
+  if (read(fd, magic, sizeof(magic))==sizeof(magic) && memcmp(magic, RLOG_MAGIC, sizeof(magic))==0) {
+    replay_length = read_log_steps(fd, &replay_steps);
+    close(fd);
+  } else {
+    close(fd);
+    text = read_file(path);
+    for (line=text; line; line=nl) {
+      if ((nl = strchr(line, '\n')))
+        *nl++ = '\0';
+      if (sscanf(line, "> %lf %lf %lf %n", &start, &end, &sec, &n)!=3 || line[n]=='\0')
+        continue;
+      line += n;
+      line[strcspn(line, " \t\r")] = '\0';
+      add_replay_step(&replay_steps, &replay_length, &capacity, start, end, end-start, line);
+    }
+    rebase_replay_steps(replay_steps, replay_length);
+  }
+  if (replay_length==0)
+    error("%s: no steps to replay", path);
+}
+
+// A chirp's sweep rate depends on its length, so it is rebuilt for the
+// duration the step wanted, where the log has it.
+static const struct pwm *replay_chirp(struct sched_compiler *c, int k, const char *act_name,
+                                      double f0, double f1, int kind) {
+  activity_t act = activity_by_name(act_name, strlen(act_name));
+  double sec = replay_steps[k].wanted;
+  int i;
+  if (act==A_NONE || act==A_SLEEP || !(f0>0 && f1>0 && sec>0))
+    return NULL;
+  for (i=0; i<c->num_pwms; ++i)
+    if (strcmp(c->pwms[i]->name, replay_steps[k].name)==0 && c->pwms[i]->sec==sec)
+      return c->pwms[i];
+  if (c->num_pwms==SCHED_MAX_PWMS)
+    sched_error(c, k, "too many different pwm steps");
+  return c->pwms[c->num_pwms++] = make_chirp(act, f0, f1, sec, kind);
+}
+
+// Step names of PWM steps read e.g. MUL/20us/10-90%. The edges are worked
+// out once per name, for the longest step that has it.
+static const struct pwm *replay_pwm(struct sched_compiler *c, int k) {
+  const char *name = replay_steps[k].name;
+  char act_name[32];
+  double period_us, duty0, duty1, sec = 0, f0, f1;
+  activity_t act;
+  int i, n = 0;
+  if (sscanf(name, "%31[^/]/chirp/%lf-%lfHz%n", act_name, &f0, &f1, &n)==3)
+    return replay_chirp(c, k, act_name, f0, f1, strcmp(name+n, "/log")==0 ? CHIRP_LOG : CHIRP_LINEAR);
+  for (i=0; i<c->num_pwms; ++i)
+    if (strcmp(c->pwms[i]->name, name)==0)
+      return c->pwms[i];
+  if (sscanf(name, "%31[^/]/%lfus/%lf%n", act_name, &period_us, &duty0, &n)!=3)
+    return NULL;
+  duty1 = duty0;
+  if (name[n]=='-' && sscanf(name+n, "-%lf%n", &duty1, &n)!=1)
+    return NULL;
+  act = activity_by_name(act_name, strlen(act_name));
+  if (act==A_NONE || act==A_SLEEP)
+    return NULL;
+  for (i=k; i<replay_length; ++i)
+    if (strcmp(replay_steps[i].name, name)==0)
+      sec = MAX(sec, replay_steps[i].end-replay_steps[i].start);
+  if (c->num_pwms==SCHED_MAX_PWMS)
+    sched_error(c, k, "too many different pwm steps");
+  c->pwms[c->num_pwms] = make_pwm(act, period_us*1e-6, duty0, duty1, sec);
+  snprintf(c->pwms[c->num_pwms]->name, sizeof(c->pwms[0]->name), "%s", name);
+  return c->pwms[c->num_pwms++];
+}
+
+// Errors name the step rather than a line
+static void compile_replay(struct timeline *tl, const char *path, struct sched_compiler *c) {
+  const struct pwm *pwm;
+  activity_t act;
+  int k;
+  c->tl = tl;
+  c->file = path;
+  for (k=0; k<replay_length; ++k) {
+    const struct replay_step *step = &replay_steps[k];
+    tl->end_sec = step->start;
+    if ((act = activity_by_name(step->name, strlen(step->name)))!=A_NONE)
+      sched_add(tl, act, step->end-step->start);
+    else if (strchr(step->name, ':'))
+      sched_add_mix(tl, sched_mix(c, k, step->name), step->end-step->start);
+    else if ((pwm = replay_pwm(c, k))!=NULL) {
+      sched_add(tl, pwm->activity, step->end-step->start);
+      tl->steps[tl->length-1].pwm = pwm;
+    } else
+      sched_error(c, k, "cannot replay step %s", step->name);
+  }
+  sched_finish(tl);
+}
+
+// Compares the steps of this run's log with the recording
+static void report_replay(int fd) {
+  struct replay_step *done;
+  int n = read_log_steps(fd, &done), k;
+  double start_sum = 0, start_max = 0, dur_sum = 0, dur_max = 0;
+  puts("# Replay: start recorded, achieved, diff (us); duration recorded, achieved, diff (us); name");
+  for (k=0; k<n && k<replay_length; ++k) {
+    const struct replay_step *want = &replay_steps[k], *got = &done[k];
+    double dstart = (got->start-want->start)*1e6;
+    double ddur = ((got->end-got->start)-(want->end-want->start))*1e6;
+    printf("= %12.9f %12.9f %+10.3f  %12.9f %12.9f %+10.3f  %s\n",
+           want->start, got->start, dstart, want->end-want->start, got->end-got->start, ddur, want->name);
+    start_sum += fabs(dstart);
+    start_max = MAX(start_max, fabs(dstart));
+    dur_sum += fabs(ddur);
+    dur_max = MAX(dur_max, fabs(ddur));
+  }
+  if (k>0)
+    printf("# Replay: start off by mean %.3fus, max %.3fus; duration by mean %.3fus, max %.3fus over %d steps\n",
+           start_sum/k, start_max, dur_sum/k, dur_max, k);
+  if (n!=replay_length)
+    printf("# Replay: %d of %d recorded steps ran\n", n, replay_length);
+  free(done);
+}
+
+
+/****************************************************************************/
+// Monitor
+//
+// With --monitor MS a low-priority thread reads the clock of every CPU in
+// --cpus and every thermal zone from sysfs that often, and logs them.
+// Separately, the activity thread corrects its calibration between steps.
+// The tick rate is compared with CLOCK_MONOTONIC over windows of a second
+// or more. If the two disagree by more than --drift-ppm, ticks_per_sec and
+// the rest of the timeline are rescaled. And a loop whose overshoot says
+// its block time has left the --loop-bound range moves to the next unroll.
+// Both corrections go to the log.
+
+#define DRIFT_WINDOW_MUSEC MUSEC_SEC
+#define ADAPT_STEPS 8           // overshoot samples per unroll decision
+
+static int monitor_msec = 0;
+static int monitor_fd[MAX_WORKERS+MONITOR_MAX_ZONES];
+static struct log_sample monitor_template;   // ids filled in, readings not
+static atomic_int monitor_stop;
+static pthread_t monitor_thread;
+
+static long long drift_ppm = 2000;
+static int adapt_loops = 1;
+static tick_t drift_tick0;
+static musec_t drift_musec0;
+static long long adapt_over[NUM_ACTIVITY][ADAPT_STEPS];
+static int adapt_count[NUM_ACTIVITY];
+
+static int read_sysfs_int(int fd, int32_t *value) {
+  char buf[32];
+  ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+  if (n<=0)
+    return 0;
+  buf[n] = '\0';
+  *value = atol(buf);
+  return 1;
+}
+
+static void *monitor_main(void *arg) {
+  struct timespec period = {monitor_msec/1000, (monitor_msec%1000)*1000000L};
+  struct log_sample sample = monitor_template;
+  int k;
+  lower_thread_priority();
+  while (!atomic_load(&monitor_stop)) {
+    sample.time_musec = get_time_musec();
+    for (k=0; k<sample.cpus+sample.zones; ++k)
+      if (!read_sysfs_int(monitor_fd[k], &sample.value[2*k+1]))
+        sample.value[2*k+1] = -1;
+    tell_log_sample(&sample);
+    nanosleep(&period, NULL);
+  }
+  return NULL;
+}
+
+static void start_monitor(const int *cpus, int ncpus) {
+  char path[128];
+  int k, fd, n = 0;
+  if (monitor_msec<=0)
+    return;
+  for (k=0; k<ncpus; ++k) {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpus[k]);
+    if ((fd = open(path, O_RDONLY))>=0) {
+      monitor_fd[n] = fd;
+      monitor_template.value[2*n++] = cpus[k];
+    }
+  }
+  monitor_template.cpus = n;
+  for (k=0; k<MONITOR_MAX_ZONES; ++k) {
+    snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/temp", k);
+    if ((fd = open(path, O_RDONLY))<0)
+      break; // zones are numbered without gaps
+    monitor_fd[n] = fd;
+    monitor_template.value[2*n++] = k;
+  }
+  monitor_template.zones = n-monitor_template.cpus;
+  printf("# Monitor: every %dms, %d CPU clocks, %d thermal zones\n",
+         monitor_msec, monitor_template.cpus, monitor_template.zones);
+  if (n==0) {
+    monitor_msec = 0;
+    return;
+  }
+  if (pthread_create(&monitor_thread, NULL, monitor_main, NULL)!=0)
+    error("Cannot start monitor thread");
+}
+
+static void finish_monitor() {
+  int k;
+  if (monitor_msec<=0)
+    return;
+  atomic_store(&monitor_stop, 1);
+  pthread_join(monitor_thread, NULL);
+  for (k=0; k<monitor_template.cpus+monitor_template.zones; ++k)
+    close(monitor_fd[k]);
+}
+
+// Where a run is on the tick counter: timeline offsets (in ticks as
+// compiled) become deadlines by origin + (offset-offset0) * scale.
+struct clock_map {
+  tick_t origin;
+  tick_t offset0;
+  double scale;
+};
+
+static inline tick_t map_ticks(const struct clock_map *map, tick_t offset) {
+  return map->origin + (tick_t)((offset-map->offset0)*map->scale);
+}
+
+static musec_t monotonic_musec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*MUSEC_SEC + ts.tv_nsec/1000;
+}
+
+// Called between steps, with the offset of the step that comes next.
+static void check_tick_rate(struct clock_map *map, tick_t next_offset) {
+  struct log_correction fix;
   tick_t now;
-  say("SLEEP");
-  entry.activity = "SLEEP";
-//  start_shouting(A_SLEEP, sec*slowdown);
-  if (spiking)
-    spike(A_SLEEP);
+  musec_t m;
+  double measured, drift;
+  if (drift_ppm<=0)
+    return;
   rdtscll(now);
-  coarse_sleep((musec_t)(sec*slowdown*MUSEC_SEC), &entry.start_musec, &entry.end_musec);
-//  stop_shouting();
+  m = monotonic_musec();
+  if (drift_musec0==0 || m-drift_musec0 < DRIFT_WINDOW_MUSEC) {
+    if (drift_musec0==0) {
+      drift_tick0 = now;
+      drift_musec0 = m;
+    }
+    return;
+  }
+  measured = (double)(now-drift_tick0)*MUSEC_SEC/(m-drift_musec0);
+  drift = measured/ticks_per_sec - 1;
+  drift_tick0 = now;
+  drift_musec0 = m;
+  if (fabs(drift)*1e6 < drift_ppm)
+    return;
+  map->origin = map_ticks(map, next_offset);
+  map->offset0 = next_offset;
+  map->scale *= measured/ticks_per_sec;
+  fix.fix = RLOG_FIX_TICK_RATE;
+  fix.name = NULL;
+  fix.time_musec = get_time_musec();
+  fix.before = ticks_per_sec;
+  fix.after = measured;
+  tell_log_correction(&fix);
+  ticks_per_sec = (tick_t)(measured+0.5);
+  note("Tick rate drifted %+.0fppm, now %lld per sec", drift*1e6, ticks_per_sec);
+}
+
+// A loop overshoots its end tick by up to one block. If most of the last
+// few steps overshot well past the bound the block has grown (the core
+// slowed down); if none came close, a longer unroll would still fit.
+static void adapt_unroll(activity_t act, long long over_nsec) {
+  struct log_correction fix;
+  long long first = 0, second = 0;
+  int k, u = loop_unroll[act];
+  if (!adapt_loops || act==A_SLEEP || get_loop(act)==NULL)
+    return;
+  adapt_over[act][adapt_count[act]++ % ADAPT_STEPS] = over_nsec;
+  if (adapt_count[act] < ADAPT_STEPS)
+    return;
+  for (k=0; k<ADAPT_STEPS; ++k) {
+    if (adapt_over[act][k] > first) {
+      second = first;
+      first = adapt_over[act][k];
+    } else if (adapt_over[act][k] > second) {
+      second = adapt_over[act][k];
+    }
+  }
+  if (second > 3*loop_bound_nsec/2 && u>0)
+    --u;
+  else if (first < loop_bound_nsec/5 && u<NUM_UNROLLS-1)
+    ++u;
+  else
+    return;
+  fix.fix = RLOG_FIX_UNROLL;
+  fix.name = activity_name[act];
+  fix.time_musec = get_time_musec();
+  fix.before = unroll_ops[loop_unroll[act]];
+  fix.after = unroll_ops[u];
+  tell_log_correction(&fix);
+  note("%s loop now reads the clock every %d", activity_name[act], unroll_ops[u]);
+  loop_unroll[act] = u;
+  set_loop(act, activity_loops[act][u]);
+  adapt_count[act] = 0;
+}
+
+
+/****************************************************************************/
+// Calibration cache
+//
+// Full calibration takes up to a few seconds, which adds up on rigs that
+// restart rattle all the time. Its results are kept in a text file with one
+// line per configuration: a key naming the CPU model, the core the activity
+// thread is pinned to, that core's cpufreq governor, the kernel and the
+// options that change the results, then a tab and name=value fields. A
+// matching line is used after a few milliseconds of probing (tick rate and
+// the ADD loop) agree with it; otherwise rattle calibrates fully and
+// replaces the line.
+
+#define CALIB_TPS_TOLERANCE 0.005   // relative difference the probe accepts
+#define CALIB_LOOP_TOLERANCE 0.25
+#define CALIB_PROBE_SEC 0.005
+
+static int read_first_line(const char *path, char *buf, size_t size) {
+  FILE *f = fopen(path, "r");
+  int ok = f!=NULL && fgets(buf, size, f)!=NULL;
+  if (f)
+    fclose(f);
+  if (ok)
+    buf[strcspn(buf, "\n")] = '\0';
+  return ok;
+}
+
+static void cpu_model(int core, char *buf, size_t size) {
+  snprintf(buf, size, "unknown");
+#if defined(__x86_64__) || defined(__i386__)
+  {
+    unsigned int regs[13] = {0}, i;
+    if (__get_cpuid(0x80000000, &regs[0], &regs[1], &regs[2], &regs[3]) && regs[0]>=0x80000004) {
+      for (i=0; i<3; ++i)
+        __get_cpuid(0x80000002+i, &regs[4*i], &regs[4*i+1], &regs[4*i+2], &regs[4*i+3]);
+      regs[12] = 0;
+      snprintf(buf, size, "%s", (const char *)regs);
+    }
+  }
+#elif defined(__APPLE__)
+  if (sysctlbyname("machdep.cpu.brand_string", buf, &size, NULL, 0)!=0)
+    sysctlbyname("hw.machine", buf, &size, NULL, 0);
+#elif defined(__linux__)
+  {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/regs/identification/midr_el1", core);
+    read_first_line(path, buf, size);
+  }
+#endif
+}
+
+static void calibration_key(char *key, size_t size, int core, const char *timebase_request) {
+  char model[128], governor[64] = "none", path[128];
+  struct utsname uts;
+  char *p;
+  cpu_model(core, model, sizeof(model));
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", core);
+  read_first_line(path, governor, sizeof(governor));
+  if (uname(&uts)!=0)
+    memset(&uts, 0, sizeof(uts));
+  snprintf(key, size, "cpu=%s core=%d governor=%s kernel=%s %s %s timebase=%s memory=%zu/%zu/%s/%d/%s loop-bound=%lld partners=%s",
+           model, core, governor, uts.sysname, uts.release, uts.version,
+           timebase_request ? timebase_request : "auto", mem_ws, mem_stride, mem_mode_name[mem_mode],
+           mem_write_pct, mem_pages_name[mem_pages], loop_bound_nsec, partner_list);
+  for (p=key; *p; ++p)
+    if (*p=='\t' || *p=='\n')
+      *p = ' ';
+}
+
+// Takes over the fields of a cache line, if they cover this build and
+// configuration. Returns 0 if anything is missing.
+static int apply_calibration(char *fields, float calib_sec) {
+  char *field, *save;
+  double cached_calib_sec = 0;
+  int act, tb, have_timebase = 0;
+  probe_timebases();
+  for (act=0; act<NUM_ACTIVITY; ++act)
+    set_loop(act, NULL);
+  for (field = strtok_r(fields, " \n", &save); field; field = strtok_r(NULL, " \n", &save)) {
+    char *eq = strchr(field, '=');
+    if (eq==NULL)
+      return 0;
+    *eq++ = '\0';
+    if (strcmp(field, "calib")==0) {
+      cached_calib_sec = atof(eq);
+    } else if (strcmp(field, "timebase")==0) {
+      for (tb=0; tb<NUM_TIMEBASE && strcmp(eq, timebase_name[tb])!=0; ++tb)
+        ;
+      if (tb==NUM_TIMEBASE || !timebase_info[tb].available)
+        return 0;
+      timebase = tb;
+      have_timebase = 1;
+    } else if (strcmp(field, "granularity")==0) {
+      sleep_granularity = atoll(eq);
+    } else if (strncmp(field, "tb.", 3)==0) {
+      for (tb=0; tb<NUM_TIMEBASE && strcmp(field+3, timebase_name[tb])!=0; ++tb)
+        ;
+      if (tb<NUM_TIMEBASE && sscanf(eq, "%lf/%lf/%lf", &timebase_info[tb].ticks_per_sec,
+                                    &timebase_info[tb].read_nsec, &timebase_info[tb].resolution_nsec)!=3)
+        return 0;
+    } else if (strncmp(field, "loop.", 5)==0) {
+      int ops, u;
+      act = activity_by_name(field+5, strlen(field+5));
+      if (act==A_NONE || activity_loops[act]==NULL)
+        return 0;
+      if (sscanf(eq, "%d/%lf/%lf", &ops, &loop_block_nsec[act], &loop_ops_per_sec[act])!=3)
+        return 0;
+      for (u=0; u<NUM_UNROLLS && unroll_ops[u]!=ops; ++u)
+        ;
+      if (u==NUM_UNROLLS)
+        return 0;
+      loop_unroll[act] = u;
+      set_loop(act, activity_loops[act][u]);
+    }
+  }
+  if (cached_calib_sec<0.99*calib_sec || !have_timebase || timebase_info[timebase].ticks_per_sec<=0)
+    return 0;
+  for (act=0; act<NUM_ACTIVITY; ++act)
+    if (activity_loops[act] && get_loop(act)==NULL)
+      return 0;
+  return 1;
+}
+
+// Returns 1 if the cache had a line for this key that the probe confirms.
+static int load_calibration(const char *path, const char *key, float calib_sec) {
+  FILE *f = path ? fopen(path, "r") : NULL;
+  char *line = NULL;
+  size_t capacity = 0, key_len = strlen(key);
+  int found = 0;
+  struct timebase_info cached;
+  double block_nsec, ops_per_sec, tps_error, loop_error;
+  if (f==NULL)
+    return 0;
+  while (!found && getline(&line, &capacity, f)>0)
+    found = strncmp(line, key, key_len)==0 && line[key_len]=='\t';
+  fclose(f);
+  if (!found || !apply_calibration(line+key_len+1, calib_sec)) {
+    free(line);
+    return 0;
+  }
+  free(line);
+
+  cached = timebase_info[timebase];
+  ticks_per_sec = (long long)(cached.ticks_per_sec+0.5);
+  calibrate_timebase(timebase, CALIB_PROBE_SEC);
+  tps_error = timebase_info[timebase].ticks_per_sec/cached.ticks_per_sec - 1;
+  timebase_info[timebase] = cached;
+  time_loop(A_ADD, loop_unroll[A_ADD], &block_nsec, &ops_per_sec); // warm-up
+  time_loop(A_ADD, loop_unroll[A_ADD], &block_nsec, &ops_per_sec);
+  loop_error = block_nsec/loop_block_nsec[A_ADD] - 1;
+  if (fabs(tps_error)>CALIB_TPS_TOLERANCE || fabs(loop_error)>CALIB_LOOP_TOLERANCE) {
+    printf("# Calibration cache is stale (tick rate %+.3f%%, ADD %+.0f%%), recalibrating\n",
+           100*tps_error, 100*loop_error);
+    return 0;
+  }
+  printf("# Calibration from %s (probe: tick rate %+.3f%%, ADD %+.0f%%)\n", path, 100*tps_error, 100*loop_error);
+  return 1;
+}
+
+// Replaces (or adds) the line for key with the current calibration.
+static void save_calibration(const char *path, const char *key, float calib_sec) {
+  char *tmp_path, *line = NULL;
+  size_t capacity = 0, key_len = strlen(key);
+  FILE *in, *out;
+  int tb, act;
+  if (path==NULL)
+    return;
+  if ((tmp_path = malloc(strlen(path)+16))==NULL)
+    error("save_calibration: malloc failed");
+  sprintf(tmp_path, "%s.%d", path, (int)getpid());
+  if ((out = fopen(tmp_path, "w"))==NULL) {
+    printf("# WARNING: cannot write calibration cache %s: %s\n", tmp_path, strerror(errno));
+    free(tmp_path);
+    return;
+  }
+  if ((in = fopen(path, "r"))!=NULL) {
+    while (getline(&line, &capacity, in)>0)
+      if (!(strncmp(line, key, key_len)==0 && line[key_len]=='\t'))
+        fputs(line, out);
+    fclose(in);
+    free(line);
+  }
+  fprintf(out, "%s\tcalib=%g timebase=%s granularity=%lld", key, calib_sec, timebase_name[timebase], sleep_granularity);
+  for (tb=0; tb<NUM_TIMEBASE; ++tb)
+    if (timebase_info[tb].available)
+      fprintf(out, " tb.%s=%.1f/%.2f/%.2f", timebase_name[tb], timebase_info[tb].ticks_per_sec,
+              timebase_info[tb].read_nsec, timebase_info[tb].resolution_nsec);
+  for (act=0; act<NUM_ACTIVITY; ++act)
+    if (get_loop(act))
+      fprintf(out, " loop.%s=%d/%.2f/%.6g", activity_name[act], unroll_ops[loop_unroll[act]],
+              loop_block_nsec[act], loop_ops_per_sec[act]);
+  fprintf(out, "\n");
+  if (fclose(out)!=0 || rename(tmp_path, path)!=0) {
+    printf("# WARNING: cannot write calibration cache %s: %s\n", path, strerror(errno));
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+
+static const char *default_calib_cache() {
+  static char path[1024];
+  const char *home = getenv("HOME");
+  snprintf(path, sizeof(path), "%s/.rattle-calib", home ? home : "/tmp");
+  return path;
+}
+
+
+/****************************************************************************/
+// Benchmark
+//
+// --bench FILE characterises the host instead of running a schedule, and
+// writes JSON. Every measurement follows the same rules, recorded in the
+// output: one warm-up run that is thrown away, then a fixed number of
+// repetitions reduced to percentiles. Numbers from different hosts and
+// releases are comparable as long as "version" matches.
+
+#define BENCH_VERSION 1
+#define BENCH_REPS 15              // repetitions of each cost measurement
+#define BENCH_SAMPLES 64           // sleeps, idles and steps per setting
+#define BENCH_DURATION_REPS 32     // runs per activity and duration
+#define BENCH_PERCENTILE 0.95      // what a duration's accuracy is judged by
+
+static const int bench_sleep_musec[] = {50, 200, 1000, 5000};
+static const int bench_duration_musec[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+static double bench_accuracy = 0.01;   // --bench-accuracy, as a fraction
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x<y ? -1 : x>y;
+}
+
+// Sorts v
+static double percentile(double *v, int n, double p) {
+  int i = (int)ceil(p*n)-1;
+  qsort(v, n, sizeof(double), compare_double);
+  return v[MIN(MAX(i, 0), n-1)];
+}
+
+static void bench_dist(FILE *f, double *v, int n) {
+  double p50 = percentile(v, n, 0.5);
+  fprintf(f, "{\"min\": %.4g, \"p50\": %.4g, \"p90\": %.4g, \"p99\": %.4g, \"max\": %.4g}",
+          v[0], p50, percentile(v, n, 0.9), percentile(v, n, 0.99), v[n-1]);
+}
+
+static void bench_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; ++s)
+    if (*s=='"' || *s=='\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s<0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  fputc('"', f);
+}
+
+static inline tick_t read_timebase(timebase_t tb) {
+  switch (tb) {
+  case TB_CNTVCT: return read_cntvct();
+  case TB_RDTSC:  return read_rdtsc();
+  case TB_RDTSCP: return read_rdtscp();
+  default:        return read_monoraw();
+  }
+}
+
+// Back-to-back reads of one backend, timed with CLOCK_MONOTONIC_RAW so the
+// selected timebase is left alone for the other threads.
+static void bench_clocks(FILE *f) {
+  double read_nsec[BENCH_REPS];
+  timebase_t tb;
+  int r, i, first = 1;
+  fprintf(f, "  \"clock_reads\": [");
+  for (tb=0; tb<NUM_TIMEBASE; ++tb) {
+    const struct timebase_info *info = &timebase_info[tb];
+    volatile tick_t sink;
+    if (!info->available)
+      continue;
+    for (r=-1; r<BENCH_REPS; ++r) {
+      tick_t t0 = read_monoraw();
+      for (i=0; i<TIMEBASE_COST_READS; ++i)
+        sink = read_timebase(tb);
+      if (r>=0)
+        read_nsec[r] = (double)(read_monoraw()-t0)/TIMEBASE_COST_READS;
+    }
+    (void)sink;
+    fprintf(f, "%s\n    {\"name\": \"%s\", \"selected\": %s, \"ticks_per_sec\": %.1f, \"nominal_hz\": %.0f, "
+            "\"resolution_ns\": %.2f, \"read_ns\": ", first ? "" : ",", timebase_name[tb], tb==timebase ? "true" : "false",
+            info->ticks_per_sec, info->nominal_hz, info->resolution_nsec);
+    bench_dist(f, read_nsec, BENCH_REPS);
+    fputc('}', f);
+    first = 0;
+  }
+  fprintf(f, "\n  ],\n");
+}
+
+static void bench_loops(FILE *f) {
+  double block_nsec[BENCH_REPS], ops_per_sec[BENCH_REPS];
+  int act, u, r, first = 1;
+  fprintf(f, "  \"loops\": [");
+  for (act=0; act<NUM_ACTIVITY; ++act) {
+    if (get_loop(act)==NULL)
+      continue;
+    fprintf(f, "%s\n    {\"activity\": \"%s\", \"chosen_unroll\": %d, \"unrolls\": [", first ? "" : ",",
+            activity_name[act], unroll_ops[loop_unroll[act]]);
+    for (u=0; u<NUM_UNROLLS; ++u) {
+      for (r=-1; r<BENCH_REPS; ++r)
+        time_loop(act, u, &block_nsec[MAX(r, 0)], &ops_per_sec[MAX(r, 0)]);
+      fprintf(f, "%s\n      {\"ops_per_block\": %d, \"block_ns\": ", u ? "," : "", unroll_ops[u]);
+      bench_dist(f, block_nsec, BENCH_REPS);
+      fprintf(f, ", \"ops_per_sec\": ");
+      bench_dist(f, ops_per_sec, BENCH_REPS);
+      fputc('}', f);
+    }
+    fprintf(f, "]}");
+    first = 0;
+  }
+  fprintf(f, "\n  ],\n");
+}
+
+// Overshoot of coarse_sleep() and of idle_until(), in microseconds
+static void bench_sleeps(FILE *f) {
+  double over[BENCH_SAMPLES];
+  int d, s, idle;
+  for (idle=0; idle<2; ++idle) {
+    fprintf(f, "  \"%s\": [", idle ? "idle_until" : "coarse_sleep");
+    for (d=0; d<(int)(sizeof(bench_sleep_musec)/sizeof(int)); ++d) {
+      musec_t want = bench_sleep_musec[d];
+      for (s=-1; s<BENCH_SAMPLES; ++s) {
+        tick_t start, end;
+        rdtscll(start);
+        if (idle)
+          idle_until(start+want*ticks_per_sec/MUSEC_SEC);
+        else
+          coarse_sleep(want, NULL, NULL);
+        rdtscll(end);
+        over[MAX(s, 0)] = 1e6*(end-start)/ticks_per_sec - want;
+      }
+      fprintf(f, "%s\n    {\"request_us\": %d, \"overshoot_us\": ", d ? "," : "", (int)want);
+      bench_dist(f, over, BENCH_SAMPLES);
+      fputc('}', f);
+    }
+    fprintf(f, "\n  ],\n");
+  }
+}
+
+// The shortest step each activity ends within bench_accuracy of its
+// length, at BENCH_PERCENTILE. SLEEP is idle_until().
+static void bench_durations(FILE *f) {
+  double err[BENCH_DURATION_REPS];
+  int act, d, r, first = 1;
+  fprintf(f, "  \"min_duration\": [");
+  for (act=A_SLEEP; act<NUM_ACTIVITY; ++act) {
+    double min_musec = -1, p = 0;
+    if (act!=A_SLEEP && get_loop(act)==NULL)
+      continue;
+    for (d=0; d<(int)(sizeof(bench_duration_musec)/sizeof(int)) && min_musec<0; ++d) {
+      tick_t len = bench_duration_musec[d]*ticks_per_sec/MUSEC_SEC;
+      for (r=-1; r<BENCH_DURATION_REPS; ++r) {
+        tick_t start, end;
+        rdtscll(start);
+        if (act==A_SLEEP)
+          idle_until(start+len);
+        else
+          get_loop(act)(start+len);
+        rdtscll(end);
+        err[MAX(r, 0)] = fabs((double)(end-start-len));
+      }
+      p = percentile(err, BENCH_DURATION_REPS, BENCH_PERCENTILE)*1e9/ticks_per_sec;
+      if (p <= bench_accuracy*bench_duration_musec[d]*1000)
+        min_musec = bench_duration_musec[d];
+    }
+    fprintf(f, "%s\n    {\"activity\": \"%s\", ", first ? "" : ",", activity_name[act]);
+    if (min_musec>0)
+      fprintf(f, "\"min_us\": %.0f, \"error_ns\": %.1f}", min_musec, p);
+    else
+      fprintf(f, "\"min_us\": null}");
+    first = 0;
+  }
+  fprintf(f, "\n  ],\n");
+}
+
+// Spread of the workers' actual starts and ends over short MUL steps
+static void bench_barrier(FILE *f) {
+  double start_skew[BENCH_SAMPLES], end_skew[BENCH_SAMPLES], late[BENCH_SAMPLES];
+  struct step step = {.activity = A_MUL};
+  struct log_entry entry;
+  struct log_cores cores;
+  int s, k;
+  if (num_workers<2) {
+    fprintf(f, "  \"barrier_skew\": null\n");
+    return;
+  }
+  for (s=-1; s<BENCH_SAMPLES; ++s) {
+    int32_t lo = INT32_MAX, hi = INT32_MIN, end_lo = INT32_MAX, end_hi = INT32_MIN;
+    tick_t now;
+    rdtscll(now);
+    step.start = now + ticks_per_sec/1000;
+    step.end = step.start + ticks_per_sec/5000;
+    engine_perform(&step, step.start, step.end, 1.0, &entry, &cores);
+    for (k=0; k<num_workers; ++k) {
+      lo = MIN(lo, cores.start_nsec[k]);
+      hi = MAX(hi, cores.start_nsec[k]);
+      end_lo = MIN(end_lo, cores.end_nsec[k]);
+      end_hi = MAX(end_hi, cores.end_nsec[k]);
+    }
+    start_skew[MAX(s, 0)] = hi-lo;
+    end_skew[MAX(s, 0)] = end_hi-end_lo;
+    late[MAX(s, 0)] = entry.late_nsec;
+  }
+  fprintf(f, "  \"barrier_skew\": {\"workers\": %d, \"step_us\": 200, \"start_ns\": ", num_workers);
+  bench_dist(f, start_skew, BENCH_SAMPLES);
+  fprintf(f, ", \"end_ns\": ");
+  bench_dist(f, end_skew, BENCH_SAMPLES);
+  fprintf(f, ", \"late_ns\": ");
+  bench_dist(f, late, BENCH_SAMPLES);
+  fprintf(f, "}\n");
+}
+
+static void run_bench(const char *path, const char *key) {
+  FILE *f = strcmp(path, "-")==0 ? stdout : fopen(path, "w");
+  if (f==NULL)
+    error("Cannot open %s: %s", path, strerror(errno));
+  printf("# Benchmarking\n");
+  fprintf(f, "{\n  \"version\": %d,\n  \"host\": ", BENCH_VERSION);
+  bench_string(f, key);
+  fprintf(f, ",\n  \"rules\": {\"warmup\": 1, \"reps\": %d, \"samples\": %d, \"duration_reps\": %d, "
+          "\"percentile\": %g, \"accuracy\": %g, \"loop_ms\": 1, \"clock_reads\": %d},\n",
+          BENCH_REPS, BENCH_SAMPLES, BENCH_DURATION_REPS, BENCH_PERCENTILE, bench_accuracy, TIMEBASE_COST_READS);
+  fprintf(f, "  \"timebase\": \"%s\",\n  \"ticks_per_sec\": %lld,\n  \"sleep_granularity_us\": %lld,\n"
+          "  \"idle_margin_us\": %.2f,\n  \"vector\": \"%s\",\n",
+          timebase_name[timebase], ticks_per_sec, sleep_granularity, 1e6*idle_initial_margin/ticks_per_sec, vector_name);
+  bench_clocks(f);
+  bench_loops(f);
+  bench_sleeps(f);
+  bench_durations(f);
+  bench_barrier(f);
+  fprintf(f, "}\n");
+  if (f!=stdout)
+    fclose(f);
+  printf("# Done\n");
+}
+
+
+/****************************************************************************/
+// Control
+//
+// --control PATH listens on a UNIX domain socket for line commands from one
+// client at a time, e.g. with "socat - UNIX-CONNECT:PATH":
+//
+//   load FILE      compile a schedule file and run it from its start
+//   builtin NAME   the same for a built-in schedule
+//   pause          idle after the current step
+//   resume         carry on with the next step
+//   slowdown X     run the rest X times slower than compiled (1: normal)
+//   flush          sync the log file, which --log2text can read meanwhile
+//   stats          the timing table so far
+//   status         what the activity thread is doing
+//   stop           end the run as on SIGINT
+//
+// Every reply ends with a line that starts with "ok" or "error".
+// Schedules are compiled on the control thread, where errors, in the
+// schedule or otherwise, go back to the client rather than ending the run. Everything for the activity thread goes
+// through a single-producer mailbox that it checks only between steps,
+// which costs one load when it is empty. With --control, a timeline that
+// ends leaves the activity thread waiting for commands rather than exiting.
+
+#define CONTROL_RING_SIZE 16   // commands, must be power of 2
+
+enum control_op {CONTROL_LOAD, CONTROL_PAUSE, CONTROL_RESUME, CONTROL_SLOWDOWN, CONTROL_STOP};
+
+// A schedule compiled by "load" or "builtin", with the compiler that owns
+// its PWMs, mixes and sequences. Once the activity thread has moved on to
+// another, it is freed as soon as the log, say and sequence rings have got
+// past where they were then, since what is queued there may point into it.
+struct control_load {
+  struct timeline tl;
+  struct sched_compiler c;
+  char *name;
+  unsigned long log_head, say_head, sequence_head;  // when retired
+  struct control_load *next;
+};
+
+struct control_mail {
+  enum control_op op;
+  double value;                    // CONTROL_SLOWDOWN
+  struct control_load *load;       // CONTROL_LOAD
+};
+
+static struct control_mail control_ring[CONTROL_RING_SIZE];
+static _Alignas(64) atomic_ulong control_head;
+static _Alignas(64) atomic_ulong control_tail;
+static int control_fd = -1;
+static const char *control_path;
+static struct sched_compiler control_base;  // each load starts from a copy
+static pthread_t control_thread;
+static struct control_load *control_running;            // activity thread's
+static struct control_load *_Atomic control_retired;    // to the control thread
+static struct control_load *control_waiting;            // control thread's
+
+// Written by the activity thread between steps, for "status"
+static atomic_int control_step = -1;   // -1: waiting for a schedule
+static atomic_int control_paused;
+static const char *_Atomic control_schedule;
+
+static int post_control(enum control_op op, double value, struct control_load *load) {
+  unsigned long head = atomic_load_explicit(&control_head, memory_order_relaxed);
+  struct control_mail *mail = &control_ring[head & (CONTROL_RING_SIZE-1)];
+  if (head - atomic_load_explicit(&control_tail, memory_order_acquire) >= CONTROL_RING_SIZE)
+    return 0;
+  mail->op = op;
+  mail->value = value;
+  mail->load = load;
+  atomic_store_explicit(&control_head, head+1, memory_order_release);
+  return 1;
+}
+
+// Activity thread side: NULL if nothing is waiting.
+static inline const struct control_mail *peek_control() {
+  unsigned long tail = atomic_load_explicit(&control_tail, memory_order_relaxed);
+  if (tail==atomic_load_explicit(&control_head, memory_order_acquire))
+    return NULL;
+  return &control_ring[tail & (CONTROL_RING_SIZE-1)];
+}
+
+static inline void done_control() {
+  atomic_fetch_add_explicit(&control_tail, 1, memory_order_release);
+}
+
+static void free_load(struct control_load *load) {
+  int k;
+  for (k=0; k<load->tl.length; ++k)
+    free((char *)load->tl.steps[k].label);
+  free((char *)load->tl.label);
+  free(load->tl.steps);
+  for (k=0; k<load->c.num_pwms; ++k) {
+    free(load->c.pwms[k]->edges);
+    free(load->c.pwms[k]);
+  }
+  for (k=0; k<load->c.num_mixes; ++k) {
+    free((char *)load->c.mixes[k]->name);
+    free(load->c.mixes[k]);
+  }
+  for (k=0; k<load->c.num_sequences; ++k) {
+    free(load->c.sequences[k]->bits);
+    free(load->c.sequences[k]);
+  }
+  free(load->name);
+  free(load);
+}
+
+// Activity thread side, when load stops running.
+static void retire_load(struct control_load *load) {
+  load->log_head = atomic_load_explicit(&log_head, memory_order_relaxed);
+  load->say_head = atomic_load_explicit(&say_head, memory_order_relaxed);
+  load->sequence_head = atomic_load_explicit(&log_sequence_head, memory_order_relaxed);
+  load->next = atomic_load_explicit(&control_retired, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&control_retired, &load->next, load,
+                                                memory_order_release, memory_order_relaxed))
+    ;
+}
+
+// Control thread side: frees the retired loads nothing refers to any more.
+static void free_retired() {
+  struct control_load *load = atomic_exchange_explicit(&control_retired, NULL, memory_order_acquire);
+  struct control_load *next, **p;
+  for (; load; load=next) {
+    next = load->next;
+    load->next = control_waiting;
+    control_waiting = load;
+  }
+  for (p=&control_waiting; (load = *p)!=NULL; ) {
+    if (atomic_load_explicit(&log_tail, memory_order_acquire)>=load->log_head &&
+        atomic_load_explicit(&say_tail, memory_order_acquire)>=load->say_head &&
+        atomic_load_explicit(&log_sequence_tail, memory_order_acquire)>=load->sequence_head) {
+      *p = load->next;
+      free_load(load);
+    } else
+      p = &load->next;
+  }
+}
+
+// Compiles the schedule with a compiler of its own, so nothing set or
+// cached by earlier loads leaks in, and its errors going to out.
+static struct control_load *control_compile(const char *name, const char *path, FILE *out) {
+  struct control_load *load;
+  char *volatile text = NULL;   // set after setjmp()
+  jmp_buf bail;
+  free_retired();
+  if ((load = calloc(1, sizeof(*load)))==NULL || (load->name = strdup(name))==NULL)
+    error("control_compile: malloc failed");
+  load->c = control_base;
+  sched_init(&load->tl);
+  if (setjmp(bail)) {
+    error_bail = NULL;
+    fprintf(out, "error cannot load %s\n", name);
+    free(text);
+    free_load(load);
+    return NULL;
+  }
+  error_bail = &bail;
+  error_out = out;
+  text = path ? read_file(path) : strdup(find_builtin_schedule(name)->text);
+  compile_schedule(&load->tl, load->name, text, &load->c);
+  error_bail = NULL;
+  free(text);
+  return load;
+}
+
+static void control_command(char *line, FILE *out) {
+  char *cmd = strtok(line, " \t\r\n"), *arg = strtok(NULL, "\r\n");
+  struct timespec nap = {0, 1000000};
+  struct control_load *load;
+  int ok = 1;
+  if (cmd==NULL)
+    return;
+  while (arg && isspace((unsigned char)*arg))
+    ++arg;
+  if ((strcmp(cmd, "load")==0 || strcmp(cmd, "builtin")==0) && arg && *arg) {
+    if ((load = control_compile(arg, cmd[0]=='l' ? arg : NULL, out))==NULL)
+      return;
+    if (!(ok = post_control(CONTROL_LOAD, 0, load)))
+      free_load(load);
+  } else if (strcmp(cmd, "pause")==0) {
+    ok = post_control(CONTROL_PAUSE, 0, NULL);
+  } else if (strcmp(cmd, "resume")==0) {
+    ok = post_control(CONTROL_RESUME, 0, NULL);
+  } else if (strcmp(cmd, "slowdown")==0 && arg && atof(arg)>0) {
+    ok = post_control(CONTROL_SLOWDOWN, atof(arg), NULL);
+  } else if (strcmp(cmd, "stop")==0) {
+    ok = post_control(CONTROL_STOP, 0, NULL);
+  } else if (strcmp(cmd, "flush")==0) {
+    atomic_store(&log_flush_requested, 1);
+    while (atomic_load(&log_flush_requested))
+      nanosleep(&nap, NULL);
+  } else if (strcmp(cmd, "stats")==0) {
+    atomic_store(&log_report_out, out);
+    while (atomic_load(&log_report_out)!=NULL)
+      nanosleep(&nap, NULL);
+  } else if (strcmp(cmd, "status")==0) {
+    int step = atomic_load(&control_step);
+    if (step<0)
+      fprintf(out, "waiting\n");
+    else
+      fprintf(out, "%s %s step %d\n", atomic_load(&control_paused) ? "paused in" : "running",
+              atomic_load(&control_schedule), step);
+  } else {
+    fprintf(out, "error unknown command: %s\n", cmd);
+    return;
+  }
+  fprintf(out, ok ? "ok\n" : "error busy, try again\n");
+}
+
+static void *control_main(void *arg) {
+  char line[1024];
+  int fd;
+  lower_thread_priority();
+  while ((fd = accept(control_fd, NULL, NULL))>=0 || errno==EINTR) {
+    FILE *in, *out;
+    if (fd<0)
+      continue;
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+    if (in==NULL || out==NULL)
+      error("Cannot open control connection: %s", strerror(errno));
+    while (fgets(line, sizeof(line), in)) {
+      control_command(line, out);
+      fflush(out);
+    }
+    fclose(in);
+    fclose(out);
+  }
+  return NULL;
+}
+
+// base is the compiler as set up by the command line, before any schedule.
+static void start_control(const char *path, const struct sched_compiler *base, const char *first) {
+  struct sockaddr_un addr;
+  if (path==NULL)
+    return;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path)>=sizeof(addr.sun_path))
+    error("Control socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((control_fd = socket(AF_UNIX, SOCK_STREAM, 0))<0 ||
+      bind(control_fd, (struct sockaddr *)&addr, sizeof(addr))!=0 || listen(control_fd, 4)!=0)
+    error("Cannot listen on %s: %s", path, strerror(errno));
+  control_path = path;
+  control_base = *base;
+  atomic_store(&control_schedule, first);
+  if (pthread_create(&control_thread, NULL, control_main, NULL)!=0)
+    error("Cannot start control thread");
+  pthread_detach(control_thread);
+  printf("# Control socket %s\n", path);
+}
+
+static void finish_control() {
+  if (control_fd<0)
+    return;
+  close(control_fd);
+  unlink(control_path);
+}
+
+
+/****************************************************************************/
+// Execution
+
+// Runs step between the two deadlines; scale is the clock map's, which
+// stretches PWM edges the same way.
+static void perform(const struct step *step, tick_t start_tick, tick_t end_tick, double scale) {
+  struct log_entry entry;
+  struct log_cores cores;
+  activity_t act = step_activity(step, 0);
+  tick_t now;
+  if (step->label)
+    note("%s", step->label);
+  say("%s", step_name(step));
+  entry.activity = step_name(step);
+  entry.cores = 0;
+  entry.perf = 0;
+  entry.edges = 0;
+  shout(act, start_tick);
+  if (num_workers>1) {
+    engine_perform(step, start_tick, end_tick, scale, &entry, &cores);
+    if (tell_log_cores(&cores))
+      entry.cores = num_workers;
+  } else {
+    // Only the first step, or one following a step that was cut short, can
+    // be early. Otherwise we are already at (or past) the deadline.
+    idle_until(start_tick);
+    if (spiking)
+      spike(step->activity);
+    rdtscll(now);
+    entry.late_nsec = (long long)((now-start_tick)*1e9/ticks_per_sec);
+    entry.start_musec = get_time_musec();
+    if (act==A_SLEEP) {
+      idle_until(end_tick);
+    } else {
+      perf_begin();
+      if (step->pwm)
+        entry.edges = run_pwm(step->pwm, start_tick, end_tick, scale, 1);
+      else
+        get_loop(act)(end_tick);
+      perf_end();
+    }
+    rdtscll(now);
+    entry.end_musec = get_time_musec();
+    entry.over_nsec = (long long)((now-end_tick)*1e9/ticks_per_sec);
+  }
+  entry.wanted_nsec = (long long)((step->end-step->start)*1e9/ticks_per_sec);
+  if (perf_pending) {
+    entry.perf = tell_log_perf(&perf_delta);
+    perf_pending = 0;
+  }
   if (verbose>1)
-    say("  (wanted %f, took %f)", sec*slowdown, 1.0*(entry.end_musec-entry.start_musec)/MUSEC_SEC);
+    say("  (wanted %f, took %f, late %.3fus)", 1.0*(step->end-step->start)/ticks_per_sec,
+        1.0*(entry.end_musec-entry.start_musec)/MUSEC_SEC, entry.late_nsec/1000.0);
   tell_log(&entry);
+  if (step->mix==NULL && step->pwm==NULL)
+    adapt_unroll(act, entry.over_nsec);
 }
 
-static musec_t get_sleep_granularity() {
-  musec_t start, end;
-  coarse_sleep(100, NULL, NULL);
-  coarse_sleep(100, &start, &end);
-  return end-start;
+// Set by SIGINT/SIGTERM; the run stops at the next step boundary so the log
+// can still be dumped. A second signal kills the process as usual.
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+  stop_requested = 1;
+}
+
+static void catch_stop_signals() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sa.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+// Maps the given offset to a millisecond from now, leaving time to get to
+// the first deadline.
+static void rebase_clock_map(struct clock_map *map, tick_t offset) {
+  rdtscll(map->origin);
+  map->origin += ticks_per_sec/1000;
+  map->offset0 = offset;
+}
+
+// Applies --control commands between steps. Returns 1 if the next step
+// has to be mapped afresh.
+static int take_control(const struct timeline **tl, int *i, tick_t *lap, struct clock_map *map,
+                        double *slowdown_now, int *paused) {
+  const struct control_mail *mail;
+  int rebase = 0;
+  while ((mail = peek_control())!=NULL) {
+    switch (mail->op) {
+    case CONTROL_LOAD:
+      *tl = &mail->load->tl;
+      sched_log_sequences(&mail->load->c);
+      *i = 0;
+      *lap = 0;
+      // It was compiled with the corrected tick rate, so only the slowdown applies
+      map->scale = *slowdown_now;
+      rebase = 1;
+      atomic_store(&control_schedule, mail->load->name);
+      note("Control: running %s", mail->load->name);
+      if (control_running)
+        retire_load(control_running);
+      control_running = mail->load;
+      break;
+    case CONTROL_PAUSE:
+      *paused = 1;
+      break;
+    case CONTROL_RESUME:
+      rebase |= *paused;
+      *paused = 0;
+      break;
+    case CONTROL_SLOWDOWN:
+      // Rescale around the next step, like a tick rate correction
+      if (*i<(*tl)->length) {
+        tick_t next = *lap+(*tl)->steps[*i].start;
+        map->origin = map_ticks(map, next);
+        map->offset0 = next;
+      }
+      map->scale *= mail->value / *slowdown_now;
+      *slowdown_now = mail->value;
+      note("Control: slowdown %g", mail->value);
+      break;
+    case CONTROL_STOP:
+      stop_requested = 1;
+      break;
+    }
+    done_control();
+  }
+  atomic_store_explicit(&control_paused, *paused, memory_order_relaxed);
+  return rebase;
+}
+
+static void run_timeline(const struct timeline *tl) {
+  struct clock_map map = {0, 0, 1.0};
+  struct timespec nap = {0, 1000000};
+  tick_t lap = 0; // offset of the current repetition of the forever part
+  double slowdown_now = 1;
+  int i = 0, paused = 0, waited = 0;
+  if (tl->length==0 && control_fd<0)
+    return;
+  rebase_clock_map(&map, 0);
+  while (!stop_requested) {
+    const struct step *step;
+    if (peek_control() && take_control(&tl, &i, &lap, &map, &slowdown_now, &paused))
+      waited = 1;
+    if (paused || i>=tl->length) {
+      atomic_store_explicit(&control_step, i<tl->length ? i : -1, memory_order_relaxed);
+      nanosleep(&nap, NULL);
+      waited = 1;
+      continue;
+    }
+    if (waited) {
+      rebase_clock_map(&map, lap+tl->steps[i].start);
+      waited = 0;
+    }
+    atomic_store_explicit(&control_step, i, memory_order_relaxed);
+    step = &tl->steps[i];
+    perform(step, map_ticks(&map, lap+step->start), map_ticks(&map, lap+step->end), map.scale);
+    if (++i==tl->length) {
+      if (tl->loop_start<0) {
+        if (control_fd<0)
+          break;
+        continue;       // wait for the next schedule
+      }
+      i = tl->loop_start;
+      lap += tl->period;
+    }
+    check_tick_rate(&map, lap+tl->steps[i].start);
+  }
 }
 
 
@@ -482,7 +4987,15 @@ static musec_t get_sleep_granularity() {
 int main(int argc, char **argv) {
   /*** INIT ***/
   int i, trial=0, watch=0, shortcalib=0, whitenoise=0, justmem=0, justmul=0, justpause=0, mulsleep=0, mulfmul=0, quiet=0, exotic=0;
-  float d;
+  const char *timebase_request=NULL, *log_path=NULL, *mix_spec=NULL;
+  const char *schedule_path=NULL, *builtin_name=NULL, *control=NULL, *replay_path=NULL, *bench_path=NULL;
+  const char *calib_cache=default_calib_cache();
+  char calib_key[1024];
+  int recalibrate=0;
+  struct sched_compiler sc, base;
+  int j, cpus[MAX_WORKERS] = {0}, ncpus=1, partners[MAX_PARTNERS], npartners=0;
+  struct timeline tl;
+  memset(&sc, 0, sizeof(sc));
   verbose=0;
   shouting=0;
   spiking=0;
@@ -502,6 +5015,9 @@ int main(int argc, char **argv) {
       quiet = 1;
     } else if (strcmp(argv[i],"-s")==0) {
       shouting = 1;
+    } else if (strcmp(argv[i],"--shout")==0 && i+1<argc) {
+      shouting = 1;
+      shout_spec = argv[++i];
     } else if (strcmp(argv[i],"--spike")==0) {
       spiking = 1;
     } else if (strcmp(argv[i],"-f")==0) {
@@ -520,6 +5036,89 @@ int main(int argc, char **argv) {
       mulsleep=1; verbose=1; shortcalib=1;
     } else if (strcmp(argv[i],"--mulfmul")==0) {
       mulfmul=1; verbose=1; shortcalib=1;
+    } else if (strcmp(argv[i],"--timebase")==0 && i+1<argc) {
+      timebase_request = argv[++i];
+    } else if (strcmp(argv[i],"--threads")==0 && i+1<argc) {
+      ncpus = atoi(argv[++i]);
+      if (ncpus<1 || ncpus>MAX_WORKERS)
+        error("--threads must be between 1 and %d", MAX_WORKERS);
+      for (j=0; j<ncpus; ++j)
+        cpus[j] = j;
+    } else if (strcmp(argv[i],"--cpus")==0 && i+1<argc) {
+      ncpus = parse_cpu_list(argv[++i], cpus, MAX_WORKERS);
+    } else if (strcmp(argv[i],"--partners")==0 && i+1<argc) {
+      partner_list = argv[++i];
+      npartners = parse_cpu_list(partner_list, partners, MAX_PARTNERS);
+    } else if (strcmp(argv[i],"--control")==0 && i+1<argc) {
+      control = argv[++i];
+    } else if (strcmp(argv[i],"--mix")==0 && i+1<argc) {
+      mix_spec = argv[++i]; verbose=1; shortcalib=1;
+    } else if (strcmp(argv[i],"--schedule")==0 && i+1<argc) {
+      schedule_path = argv[++i]; verbose=1; shortcalib=1;
+    } else if (strcmp(argv[i],"--replay")==0 && i+1<argc) {
+      replay_path = argv[++i]; verbose=1; shortcalib=1;
+    } else if (strcmp(argv[i],"--builtin")==0 && i+1<argc) {
+      builtin_name = argv[++i]; verbose=1; shortcalib=1;
+    } else if (strcmp(argv[i],"--show-builtin")==0 && i+1<argc) {
+      fputs(find_builtin_schedule(argv[++i])->text, stdout);
+      return 0;
+    } else if (strcmp(argv[i],"--set")==0 && i+1<argc) {
+      char *eq = strchr(argv[++i], '=');
+      if (eq==NULL)
+        error("--set wants NAME=VALUE: %s", argv[i]);
+      *eq = '\0';
+      sched_set(&sc, argv[i], atof(eq+1), NULL);
+    } else if (strcmp(argv[i],"--mem-ws")==0 && i+1<argc) {
+      mem_ws = parse_size("--mem-ws", argv[++i]);
+    } else if (strcmp(argv[i],"--mem-stride")==0 && i+1<argc) {
+      mem_stride = parse_size("--mem-stride", argv[++i]);
+    } else if (strcmp(argv[i],"--mem-mode")==0 && i+1<argc) {
+      mem_mode = parse_choice("--mem-mode", argv[++i], mem_mode_name, NUM_MEM_MODES);
+    } else if (strcmp(argv[i],"--mem-pages")==0 && i+1<argc) {
+      mem_pages = parse_choice("--mem-pages", argv[++i], mem_pages_name, NUM_PAGE_KINDS);
+    } else if (strcmp(argv[i],"--mem-write")==0 && i+1<argc) {
+      mem_write_pct = atoi(argv[++i]);
+      if (mem_write_pct<0 || mem_write_pct>100)
+        error("--mem-write must be a percentage");
+    } else if (strcmp(argv[i],"--realtime")==0) {
+      realtime = 1;
+    } else if (strcmp(argv[i],"--rt-policy")==0 && i+1<argc) {
+      realtime = 1; ++i;
+      if (strcmp(argv[i],"fifo")==0)
+        rt_policy = SCHED_FIFO;
+      else if (strcmp(argv[i],"rr")==0)
+        rt_policy = SCHED_RR;
+      else
+        error("--rt-policy wants fifo or rr: %s", argv[i]);
+    } else if (strcmp(argv[i],"--rt-priority")==0 && i+1<argc) {
+      realtime = 1;
+      rt_priority = atoi(argv[++i]);
+    } else if (strcmp(argv[i],"--monitor")==0 && i+1<argc) {
+      monitor_msec = atoi(argv[++i]);
+    } else if (strcmp(argv[i],"--drift-ppm")==0 && i+1<argc) {
+      drift_ppm = atoll(argv[++i]);
+    } else if (strcmp(argv[i],"--no-adapt")==0) {
+      adapt_loops = 0;
+    } else if (strcmp(argv[i],"--bench")==0 && i+1<argc) {
+      bench_path = argv[++i];
+    } else if (strcmp(argv[i],"--bench-accuracy")==0 && i+1<argc) {
+      bench_accuracy = atof(argv[++i])/100;
+      if (!(bench_accuracy>0))
+        error("--bench-accuracy must be a positive percentage");
+    } else if (strcmp(argv[i],"--perf")==0) {
+      perf_counting = 1;
+    } else if (strcmp(argv[i],"--calib-cache")==0 && i+1<argc) {
+      ++i;
+      calib_cache = strcmp(argv[i],"none")==0 ? NULL : argv[i];
+    } else if (strcmp(argv[i],"--recalibrate")==0) {
+      recalibrate = 1;
+    } else if (strcmp(argv[i],"--loop-bound")==0 && i+1<argc) {
+      loop_bound_nsec = atoll(argv[++i]);
+    } else if (strcmp(argv[i],"--log")==0 && i+1<argc) {
+      log_path = argv[++i];
+    } else if (strcmp(argv[i],"--log2text")==0 && i+1<argc) {
+      log2text(argv[++i]);
+      return 0;
     } else
       error("Unknown command-line argument: %s", argv[i]);
   }
@@ -534,121 +5133,99 @@ int main(int argc, char **argv) {
     verbose=0;
   if (slowdown>0)
     printf("# Slowdown=%f\n", slowdown);
+  if (replay_path)
+    read_replay(replay_path);
 
+  prefault_rings(); // before any thread that uses them starts
+  if (realtime)
+    go_realtime(); // before calibrating, so idle margins are learned under it
+  pin_thread_to_cpu(cpus[0]); // calibrate on the core that runs
   start_musec = get_time_musec();
-  ticks_per_sec = get_ticks_per_sec(shortcalib ? 0.3 : 3);
-  sleep_granularity = get_sleep_granularity();
-  printf("TPS: %lld    Sleep granularity: %fsec\n", ticks_per_sec, 1.0*sleep_granularity/MUSEC_SEC);
-  //  set_realtime_sched();
-  memset(sand, 0xFF, SAND_SIZE*sizeof(int));
-//  init_shouting(); // must happen after ticks_per_sec is calibrated
+  init_memory();
+  activity_loops[A_MEMORY] = memory_loops[mem_mode];
+  init_vector();
+  start_partners(partners, npartners, ncpus);
+  calibration_key(calib_key, sizeof(calib_key), cpus[0], timebase_request);
+  if (recalibrate || !load_calibration(calib_cache, calib_key, shortcalib ? 0.3 : 3)) {
+    ticks_per_sec = get_ticks_per_sec(timebase_request, shortcalib ? 0.3 : 3);
+    sleep_granularity = get_sleep_granularity();
+    calibrate_loops();
+    save_calibration(calib_cache, calib_key, shortcalib ? 0.3 : 3);
+  }
+  report_timebases();
+  printf("TPS: %lld (%s)    Sleep granularity: %fsec\n", ticks_per_sec, timebase_name[timebase], 1.0*sleep_granularity/MUSEC_SEC);
+  report_loops();
+  init_idle();
+  start_log(log_path);
+  start_say();
+  start_engine(cpus, ncpus);
+  if (bench_path)
+    monitor_msec = shouting = 0; // benchmarks run on an otherwise quiet process
+  start_monitor(cpus, ncpus);
+  start_perf();
+  if (!bench_path)
+    catch_stop_signals();
+  start_shouting(); // must happen after ticks_per_sec is calibrated
   coarse_sleep(1, NULL, NULL); // align to clock boundary
 
   /** GO ***/
-  if (whitenoise) {
+  if (bench_path) {
+    run_bench(bench_path, calib_key);
+  } else if (whitenoise) {
+    struct timespec nap = {0, 100000000};
+    tick_t now;
     printf("! White noise !\n");
-    while (1) {
-//      start_shouting(A_NONE, 1000);
-      coarse_sleep(1000*MUSEC_SEC, 0, 0);
-    }
-  } else if (justmem) {
-    puts("! Memory only");
-    while (1)
-      perform_MEMORY(1000);
-  } else if (justmul) {
-    puts("! MUL only");
-    while (1)
-      perform_MUL(1000);
-  } else if (mulfmul) {
-#ifndef __ANDROID_API__
-    puts("! MUL/FMUL/MUL_FMUL only");
-    while (1) {
-      int i;
-      perform_MUL(1);
-//      perform_FMUL(1);
-//      perform_MUL_FMUL(1);
-      for (i=0; i<500; ++i) {
-    perform_MUL(0.001);
-//    perform_FMUL(0.001);
-      }
-      for (i=0; i<500; ++i) {
-    perform_MUL(0.0005);
-//    perform_FMUL(0.0015);
-      }
-      perform_sleep(0.2);
-    }
-#else
-    printf("not supported\n");
-#endif
-  } else if (trial) {
-    puts("! Trial");
-    while (1) {
-      perform_MUL(0.8);
-      perform_sleep(0.4);
-      perform_MEMORY(0.8);
-      perform_sleep(0.4);
-    }
-  } else if (mulsleep) {
-    puts("! MUL/SLEEP");
-    while (1) {
-      perform_MUL(0.4);
-      perform_sleep(0.2);
-    }
+    rdtscll(now);
+    shout(A_NONE, now);
+    start_usage();
+    while (!stop_requested)
+      nanosleep(&nap, NULL);
   } else {
-    if (!watch) {
-      perform_MUL(30);
-      perform_sleep(30);
-    }
-
-    if (1) {
-      d = (watch ? 1.0 : 8.0);
-      do {
-    if (verbose)
-      printf("# Activity set of %f sec\n", d);
-    perform_MUL(d);
-#ifndef __ANDROID_API__
-//    perform_FMUL(d);
-#endif
-    perform_ADD(d);
-    perform_MEMORY(d);
-    perform_PAUSE(d);
-    if (exotic) {
-      perform_DIV2(d);
-      perform_DIV8209(d);
-      perform_MEMW0(d);
-      perform_MEMW1(d);
-    }
-    perform_sleep(d);
-
-    d /= ( (d>0.5) ? 1.5 : (d>0.03) ? 1.07 : 1.02);
-      } while (d>0.00001);
+    sched_init(&tl);
+    sched_set(&sc, "watch", watch, NULL);
+    sched_set(&sc, "exotic", exotic, NULL);
+    if (mix_spec)
+      sched_set(&sc, "mix", 0, mix_spec);
+    sc.cpus = cpus;
+    sc.num_cpus = ncpus;
+    base = sc;
+    if (replay_path) {
+      printf("! Replay %s\n", replay_path);
+      compile_replay(&tl, replay_path, &sc);
+    } else if (schedule_path) {
+      printf("! Schedule %s\n", schedule_path);
+      compile_schedule(&tl, schedule_path, read_file(schedule_path), &sc);
+    } else {
+      const struct builtin_schedule *builtin = find_builtin_schedule(
+        builtin_name ? builtin_name : justmem ? "justmem" : justmul ? "justmul" : mulfmul ? "mulfmul" :
+        trial ? "trial" : mix_spec ? "mix" : mulsleep ? "mulsleep" : "sweep");
+      if (builtin->banner)
+        puts(builtin->banner);
+      compile_schedule(&tl, builtin->name, builtin->text, &sc);
     }
-
-    if (1) {
-      d = 0.65925;
-      do {
-    if (verbose)
-      printf("# Resolution set of %f sec\n", d);
-    for (i=0; i < (watch ? 3 : 10); ++i) {
-      perform_MUL(d);
-      perform_sleep(d/2);
-    }
-    d /= ( (d>0.1) ? 1.5 : (d>0.01) ? 1.3 : 1.1);
-      } while (d>0.00001);
-    }
-  
-    if (1) {
-      for (i=0; i<0; ++i) {
-    perform_MUL(0.01);
-    perform_sleep(0.005);
-      }
-    }
-  
+    printf("# Schedule: %d steps, %.3f sec%s\n", tl.length, tl.end_sec*slowdown,
+           tl.loop_start>=0 ? ", repeating" : "");
+    sched_log_sequences(&sc);
+    start_control(control, &base, replay_path ? replay_path : schedule_path ? schedule_path :
+                  builtin_name ? builtin_name : "default");
+    start_usage();
+    run_timeline(&tl);
   }
-//  stop_shouting();
+  finish_control();
+  finish_monitor();
+  finish_engine();
+  finish_partners();
+  finish_say();
+  if (verbose)
+    report_idle();
+  if (realtime || verbose)
+    report_usage();
+  finish_shouting();
   if (spiking)
     cleanup_spiking();
   dump_log();
+  if (replay_path)
+    report_replay(log_fd);
   return 0;
 }
 